@@ -28,134 +28,1864 @@
 #include <ZL_Input.h>
 #include <ZL_SynthImc.h>
 #include <../Opt/chipmunk/chipmunk.h>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <algorithm>
+#if !defined(__wasm__) && !defined(__EMSCRIPTEN__)
+#define SIM_THREAD_SUPPORT
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+//High resolution time in seconds for measurements
+#ifdef SIM_THREAD_SUPPORT
+static double PerfTime() { return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+#else
+static double PerfTime() { return ZL_Application::GetTicks() / 1000.0; }
+#endif
+
+//Scoped hot path timers for the profiler overlay, these compile to nothing without ZILLALOG
+#ifdef ZILLALOG
+enum ProfileSlot { PROF_POSTSTEP, PROF_DRAWMONKEYS, PROF_DRAWTEXT, PROF_COUNT }; //post step runs in the simulation, the rest in drawing
+static thread_local double profTimes[PROF_COUNT];
+struct sProfileScope
+{
+	sProfileScope(ProfileSlot slot) : slot(slot), start(PerfTime()) { }
+	~sProfileScope() { profTimes[slot] += PerfTime() - start; }
+	ProfileSlot slot; double start;
+};
+struct sProfileStats { float stepMs, postStepMs; int steps, bodies, arbiters, constraints, quality; bool spatialHash; };
+#define PROFILE_SCOPE(slot) sProfileScope profileScope(slot)
+#else
+#define PROFILE_SCOPE(slot)
+#endif
+
+extern ZL_SynthImcTrack imcMusic;
+extern TImcSongData imcDataIMCMUSIC, imcDataIMCGRAB, imcDataIMCTHROW, imcDataIMCGAMEOVER;
+unsigned int HashImcSong(const TImcSongData* song);
+static ZL_Sound sndMusic;
+static bool liveAudio; //always synthesize audio even when baked files are available
+static ZL_Font fntMain;
+
+//The static parts of a world (hill, tree and the joints holding the tree)
+struct sWorldBase { cpBody tree, hill; cpPolyShape hillShape, treeShapes[2]; cpPivotJoint trunk; cpRotaryLimitJoint upright; };
+static bool holdTreeUpright; //keeps the tree from tipping over, used by the benchmark
+static ZL_Surface srfHill, srfTree, srfMonkey, srfLogo;
+static ZL_TextBuffer txtMonkeys; //game over message, the running count is drawn by MonkeyCounter
+static ZL_Color sky[4];
+static bool headless;
+static bool rigidAttach; //settled monkeys get merged into the tree body instead of hanging on pin joints
+static bool timeCallbacks; //measure time spent in collision callbacks (only when needed, timing each callback adds up)
+static struct sFrameTimes { double sim, step, collision, pairs; int steps; } frameTimes; //of the last simulation frame
+static bool spatialHash; //broadphase uses a spatial hash instead of the default bounding box tree
+static bool looseFilter = true; //monkeys that can't reach the tree anymore stop colliding with other monkeys
+static bool sleeping; //the tree with its monkeys falls asleep when settled until hit by a monkey or pushed
+static ticks_t stepTicks = 16;
+enum { MIN_STEP_TICKS = 1, MAX_STEP_TICKS = 100 }; //1000 down to 10 steps per second
+static int maxSubSteps = 4;
+
+//Monkeys live in a fixed-capacity pool with their body, shape and pin joints so gameplay does no allocations
+struct sMonkey { cpBody body; cpCircleShape shape; cpPinJoint joints[2]; cpVect prevP; cpFloat prevA; bool flip; int index; bool baked, loose, grabbing; int settleSteps; cpVect bakedOffset; cpFloat bakedAngle; };
+enum { MONKEY_POOL_SIZE = 8192 };
+static struct sAllocStats { unsigned int spaceAllocs; } allocStats;
+
+//Single producer single consumer lock-free ring buffer
+template <typename T, unsigned int N> struct sQueue
+{
+	bool Push(const T& v)
+	{
+		unsigned int t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == N) return false;
+		items[t % N] = v;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+	bool Pop(T& v)
+	{
+		unsigned int h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) return false;
+		v = items[h % N];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+	T items[N];
+	std::atomic<unsigned int> head = {0}, tail = {0};
+};
+
+//Persistent worker threads for splitting work over all cores, the calling thread joins in as worker 0
+//Tasks are claimed from a shared counter so faster workers simply take more of them
+static struct sThreadPool
+{
+	typedef void (*TaskFunc)(int task, int worker, void* user);
+	TaskFunc func;
+	void* user;
+	int count, maxThreads; //limit including the calling thread, 0 uses all cores
+	std::atomic<int> next;
+
+	void Work(int worker)
+	{
+		for (int i; (i = next.fetch_add(1)) < count;) func(i, worker, user);
+	}
+
+	#ifdef SIM_THREAD_SUPPORT
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	unsigned int generation;
+	int busy;
+	bool started, quit;
+
+	int Workers()
+	{
+		if (!started)
+		{
+			started = true;
+			for (unsigned int i = 1, n = (maxThreads ? maxThreads : std::thread::hardware_concurrency()); i < n; i++)
+				threads.push_back(std::thread(&sThreadPool::WorkerLoop, this, (int)i));
+		}
+		return 1 + (int)threads.size();
+	}
+
+	void WorkerLoop(int worker)
+	{
+		for (unsigned int seen = 0;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&]() { return quit || generation != seen; });
+				if (quit) return;
+				seen = generation;
+			}
+			Work(worker);
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!--busy) done.notify_one();
+		}
+	}
+
+	void Run(int taskCount, TaskFunc taskFunc, void* taskUser)
+	{
+		Workers();
+		func = taskFunc, user = taskUser, count = taskCount, next = 0;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			busy = (int)threads.size();
+			generation++;
+		}
+		wake.notify_all();
+		Work(0);
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&]() { return !busy; });
+	}
+
+	~sThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (size_t i = 0; i != threads.size(); i++) threads[i].join();
+	}
+	#else
+	int Workers() { return 1; }
+	void Run(int taskCount, TaskFunc taskFunc, void* taskUser)
+	{
+		func = taskFunc, user = taskUser, count = taskCount, next = 0;
+		Work(0);
+	}
+	#endif
+} ThreadPool;
+
+//Small seeded random number generator so a game seed reproduces a game exactly on any platform
+struct sRandom
+{
+	unsigned int state;
+	void Seed(unsigned int seed) { state = (seed ? seed : 0x9E3779B9); }
+	unsigned int Next() { state ^= state << 13; state ^= state >> 17; state ^= state << 5; return state; }
+	float Range(float min, float max) { return min + (max - min) * (Next() >> 8) * (1.f / 16777216.f); }
+};
+
+//Everything simulated in one world: its space, the tree, the pooled monkeys and the state carried from step to step
+//The game plays in one world, the arena steps many of them and the throw solver copies the game into worlds of its own
+struct sWorld
+{
+	cpSpace* space;
+	cpBody* tree;
+	sWorldBase base;
+	std::vector<sMonkey> pool; //sized once, the space points into it
+	std::vector<sMonkey*> free;
+	std::vector<cpBody*> bodies; //dense list of all monkeys in the space
+	struct sPoolStats { unsigned int taken, released, exhausted; } poolStats;
+	sRandom rand;
+	unsigned int step; //the step counter is the only clock of the simulation
+	int monkeys, quality;
+	bool tipped; //the joints are being released after the tree tipped over
+	bool hashed; //broadphase the space currently has
+	cpVect treePrevP;
+	cpFloat treePrevA;
+	enum { MAX_GRABS_PER_STEP = 256 };
+	sMonkey* grabs[MAX_GRABS_PER_STEP]; //monkeys whose joints get added once the step returned
+	int grabCount;
+};
+static sWorld game;
+static unsigned int simSeed;
+static unsigned int fixedSeed; //set on the command line to play the same seed every game
+
+//Inputs are quantized and applied at step boundaries, a seed plus the list of inputs replays a game bit-exactly
+enum ReplayInputType { INPUT_THROW, INPUT_IMPULSE, INPUT_QUALITY }; //a quality change stores its level in height
+struct sReplayInput { unsigned int step; unsigned char type; signed char side; unsigned short height, charge; };
+static std::vector<sReplayInput> replayInputs; //recorded inputs of the current game, or the inputs being played back
+static size_t replayPos;
+static bool replayPlaying;
+static const char* replayRecordPath;
+static bool replayInvalid; //set after a rewind, retry or broadphase switch, the recorded inputs no longer reproduce the game
+
+static void Put32(unsigned char* p, unsigned int v) { p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8); p[2] = (unsigned char)(v >> 16); p[3] = (unsigned char)(v >> 24); }
+static unsigned int Get32(const unsigned char* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24); }
+
+//Telemetry log of every step and grab for offline tuning, tools/telemetry_csv.py turns it into CSV summaries
+//File: "SMCT", version, step ticks (16 bit), then blocks of the index of their first step record, a step count and a grab count followed by
+//one column per value: step, tree angle, angular velocity, monkeys, constraints, step time in microseconds,
+//then the index of the step record a grab happened in, hit x, hit y, normal x, normal y, depth, impact
+//All values are 32 bit little endian. The simulation fills one block while a background thread writes the other
+enum { TELEMETRY_BLOCK_STEPS = 1024, TELEMETRY_BLOCK_GRABS = 256 };
+struct sTelemetryBlock
+{
+	unsigned int first, steps, grabs;
+	unsigned int step[TELEMETRY_BLOCK_STEPS], monkeys[TELEMETRY_BLOCK_STEPS], constraints[TELEMETRY_BLOCK_STEPS];
+	float angle[TELEMETRY_BLOCK_STEPS], angVel[TELEMETRY_BLOCK_STEPS], stepTime[TELEMETRY_BLOCK_STEPS];
+	unsigned int grabRecord[TELEMETRY_BLOCK_GRABS];
+	float hitX[TELEMETRY_BLOCK_GRABS], hitY[TELEMETRY_BLOCK_GRABS], normX[TELEMETRY_BLOCK_GRABS], normY[TELEMETRY_BLOCK_GRABS], depth[TELEMETRY_BLOCK_GRABS], impact[TELEMETRY_BLOCK_GRABS];
+
+	static void WriteColumn(FILE* f, const void* values, unsigned int count) //floats go through their bit pattern
+	{
+		unsigned char buf[TELEMETRY_BLOCK_STEPS * 4];
+		unsigned int v;
+		for (unsigned int i = 0; i != count; i++) memcpy(&v, (const unsigned int*)values + i, 4), Put32(buf + i * 4, v);
+		fwrite(buf, 4, count, f);
+	}
+
+	void Write(FILE* f) const
+	{
+		unsigned int counts[3] = { first, steps, grabs };
+		WriteColumn(f, counts, 3);
+		WriteColumn(f, step, steps); WriteColumn(f, angle, steps); WriteColumn(f, angVel, steps);
+		WriteColumn(f, monkeys, steps); WriteColumn(f, constraints, steps); WriteColumn(f, stepTime, steps);
+		WriteColumn(f, grabRecord, grabs); WriteColumn(f, hitX, grabs); WriteColumn(f, hitY, grabs);
+		WriteColumn(f, normX, grabs); WriteColumn(f, normY, grabs); WriteColumn(f, depth, grabs); WriteColumn(f, impact, grabs);
+	}
+};
+
+static struct sTelemetry
+{
+	FILE* file;
+	sTelemetryBlock blocks[2], *fill, *pending;
+	unsigned int records, dropped;
+	bool wait; //headless waits for the writer instead of dropping a block
+
+	#ifdef SIM_THREAD_SUPPORT
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wake, written;
+	bool quit;
+
+	void WriterLoop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;)
+		{
+			wake.wait(lock, [&]() { return quit || pending; });
+			if (!pending) return;
+			const sTelemetryBlock* b = pending;
+			lock.unlock();
+			b->Write(file);
+			lock.lock();
+			pending = NULL;
+			written.notify_one();
+		}
+	}
+	#endif
+
+	bool Open(const char* path)
+	{
+		if (!(file = fopen(path, "wb"))) return false;
+		unsigned char hdr[8] = { 'S', 'M', 'C', 'T', 1, 0, (unsigned char)stepTicks, (unsigned char)(stepTicks >> 8) };
+		fwrite(hdr, 8, 1, file);
+		fill = &blocks[0];
+		#ifdef SIM_THREAD_SUPPORT
+		thread = std::thread(&sTelemetry::WriterLoop, this);
+		#endif
+		return true;
+	}
+
+	void Submit()
+	{
+		#ifdef SIM_THREAD_SUPPORT
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (pending && wait) written.wait(lock, [&]() { return !pending; });
+			if (pending) { dropped++; fill->first = records, fill->steps = fill->grabs = 0; return; } //never block the frame on the disk
+			pending = fill;
+		}
+		wake.notify_one();
+		fill = (fill == &blocks[0] ? &blocks[1] : &blocks[0]);
+		#else
+		fill->Write(file);
+		#endif
+		fill->first = records, fill->steps = fill->grabs = 0;
+	}
+
+	void Step(unsigned int step, const cpBody* tree, int monkeys, int constraints, double stepTime)
+	{
+		if (!file) return;
+		sTelemetryBlock& b = *fill;
+		unsigned int i = b.steps++;
+		records++;
+		b.step[i] = step, b.angle[i] = (float)tree->a, b.angVel[i] = (float)tree->w;
+		b.monkeys[i] = monkeys, b.constraints[i] = constraints, b.stepTime[i] = (float)(stepTime * 1000000);
+		if (b.steps == TELEMETRY_BLOCK_STEPS) Submit();
+	}
+
+	void Grab(cpVect hit, cpVect norm, float depth, float impact)
+	{
+		if (!file) return;
+		if (fill->grabs == TELEMETRY_BLOCK_GRABS) Submit();
+		sTelemetryBlock& b = *fill;
+		unsigned int i = b.grabs++;
+		b.grabRecord[i] = records, b.hitX[i] = (float)hit.x, b.hitY[i] = (float)hit.y, b.normX[i] = (float)norm.x, b.normY[i] = (float)norm.y;
+		b.depth[i] = depth, b.impact[i] = impact;
+	}
+
+	void Close()
+	{
+		if (!file) return;
+		#ifdef SIM_THREAD_SUPPORT
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_one();
+		thread.join();
+		#endif
+		if (fill->steps || fill->grabs) fill->Write(file);
+		fclose(file);
+		file = NULL;
+		if (dropped) fprintf(stderr, "Telemetry: dropped %u blocks while the disk was busy\n", dropped);
+	}
+
+	~sTelemetry() { Close(); }
+} Telemetry;
+
+//Ring buffer of recent world snapshots for rewinding and the last snapshot with a steady tree for retrying
+enum { REWIND_SLOTS = 16, REWIND_INTERVAL_TICKS = 250 };
+static std::vector<unsigned char> rewindRing[REWIND_SLOTS], stableWorld;
+static int rewindHead, rewindCount;
+
+//Commands from the game to the simulation and events from the simulation back to the game
+enum SimCommandType { SIMCMD_THROW, SIMCMD_IMPULSE, SIMCMD_RESET, SIMCMD_SOLVE, SIMCMD_REWIND, SIMCMD_RETRY, SIMCMD_BROADPHASE };
+struct sSimCommand { SimCommandType type; float side, height, charge; unsigned int seed; };
+enum SimEventType { SIMEVT_GRAB, SIMEVT_GAMEOVER, SIMEVT_SUGGESTION, SIMEVT_RESTORED };
+struct sSimEvent { SimEventType type; int monkeys; float side, height, charge, grabChance, impact; };
+static sQueue<sSimCommand, 256> simCommands;
+static sQueue<sSimEvent, 1024> simEvents;
+
+//Render snapshot of the world published after each simulation frame, triple buffered so neither side ever waits
+struct sSnapMonkey { cpVect prevP, p; float prevA, a, size, r; }; //r bounds the sprite for culling
+struct sSnapTree { cpVect prevP, p; float prevA, a; };
+struct sSnapshot
+{
+	cpVect treePrevP, treeP; float treePrevA, treeA; int monkeys; ticks_t time, accum; std::vector<sSnapMonkey> list;
+	std::vector<sSnapTree> arenaTrees; std::vector<sSnapMonkey> arenaMonkeys; int arenaMonkeyCount; double arenaStepTime; int arenaSteps;
+	#ifdef ZILLALOG
+	sProfileStats prof;
+	#endif
+};
+static sSnapshot snapshots[3];
+static std::atomic<int> snapshotReady(2);
+static int snapshotWrite = 0, snapshotRead = 1;
+enum { SNAPSHOT_FRESH = 4 };
+static bool simThreaded;
+
+enum CollisionTypes
+{
+	COLLISION_NONE,
+	COLLISION_TREE,
+	COLLISION_MONKEY,
+};
+
+//Shapes of the hill and tree keep the default filter, loose monkeys only collide with those
+enum CollisionCategories { CATEGORY_WORLD = 1, CATEGORY_MONKEY = 2, CATEGORY_LOOSE = 4 };
+static const cpShapeFilter filterMonkey = { CP_NO_GROUP, CATEGORY_MONKEY, CP_ALL_CATEGORIES };
+static const cpShapeFilter filterLoose = { CP_NO_GROUP, CATEGORY_LOOSE, CATEGORY_WORLD };
+
+//Spatial hash cells fit the largest monkey
+enum { HASH_CELL_SIZE = 30, HASH_CELL_COUNT = 16384 };
+
+//Quality levels from best to cheapest, every game starts on the classic setting
+//Each sets the solver iterations, the space steps per physics step and the fraction of pin joint error corrected per 1/60 second
+struct sQualityLevel { int iterations, substeps; cpFloat jointCorrection; };
+static const sQualityLevel qualityLevels[] = { { 15, 2, .001f }, { 10, 1, .001f }, { 7, 1, .002f }, { 5, 1, .004f }, { 3, 1, .008f } };
+enum { QUALITY_START = 1, QUALITY_LEVELS = sizeof(qualityLevels) / sizeof(qualityLevels[0]) };
+
+static cpFloat JointErrorBias(int quality) { return cpfpow(1.0f - qualityLevels[quality].jointCorrection, 60.0f); }
+
+static sWorld* GetWorld(cpSpace* space) { return (sWorld*)cpSpaceGetUserData(space); }
+
+static void AddJoint(sWorld& w, cpConstraint* joint)
+{
+	cpConstraintSetErrorBias(joint, JointErrorBias(w.quality));
+	cpSpaceAddConstraint(w.space, joint);
+}
+
+//Joints can't be added while the space is stepping, the grabs of a step are queued in the world and added after it
+//instead of going through Chipmunk's post step callbacks which allocate each one
+static void AddGrabJoints(sWorld& w)
+{
+	PROFILE_SCOPE(PROF_POSTSTEP);
+	for (int i = 0; i != w.grabCount; i++)
+	{
+		sMonkey* m = w.grabs[i];
+		AddJoint(w, &m->joints[0].constraint);
+		AddJoint(w, &m->joints[1].constraint);
+		m->grabbing = false;
+	}
+	w.grabCount = 0;
+}
+
+static void InitMonkeyPool(sWorld& w)
+{
+	w.free.resize(w.pool.size());
+	for (size_t i = 0; i != w.pool.size(); i++) w.free[i] = &w.pool[w.pool.size() - 1 - i];
+	w.bodies.reserve(w.pool.size());
+}
+
+static sMonkey* TakeMonkey(sWorld& w)
+{
+	if (w.free.empty()) { w.poolStats.exhausted++; return NULL; }
+	w.poolStats.taken++;
+	sMonkey* m = w.free.back();
+	w.free.pop_back();
+	m->index = (int)w.bodies.size();
+	m->baked = m->loose = m->grabbing = false, m->settleSteps = 0;
+	w.bodies.push_back(&m->body);
+	return m;
+}
+
+static void ReleaseMonkey(sWorld& w, sMonkey* m)
+{
+	w.bodies[m->index] = w.bodies.back();
+	((sMonkey*)cpBodyGetUserData(w.bodies[m->index]))->index = m->index;
+	w.bodies.pop_back();
+	w.free.push_back(m);
+	w.poolStats.released++;
+}
+
+static void RemoveBody(cpSpace *space, cpBody* body)
+{
+	while (body->shapeList) cpSpaceRemoveShape(space, body->shapeList);
+	while (body->constraintList) cpSpaceRemoveConstraint(space, body->constraintList);
+	cpSpaceRemoveBody(space, body);
+}
+
+//Hangs a monkey onto whatever it touched, returns the impact speed or -1 if nothing got attached
+struct sGrabContact { cpVect hit, norm; float depth; };
+static float AttachMonkey(cpArbiter *arb, cpSpace *space, sGrabContact* contact = NULL)
+{
+	CP_ARBITER_GET_BODIES(arb, bMonkey, bTree);
+	float impact = (float)cpvlength(cpvsub(bMonkey->v, bTree->v));
+	cpBodySetVelocity(bMonkey, cpvzero);
+
+	if (bMonkey->constraintList && bTree->constraintList) return -1;
+	if (!bMonkey->constraintList && !bTree->constraintList) return -1;
+	sWorld& w = *GetWorld(space);
+	sMonkey* owner = (sMonkey*)cpBodyGetUserData(bMonkey->constraintList ? bTree : bMonkey); //owns the joints, the monkey that gets attached
+	if (!owner->grabbing && w.grabCount == sWorld::MAX_GRABS_PER_STEP) return -1; //grabs again next step
+
+	cpVect hit = (arb->swapped ? cpArbiterGetPointA(arb, 0) : cpArbiterGetPointB(arb, 0));
+	cpVect norm = cpArbiterGetNormal(arb); // takes swapped into account
+	float dist = cpArbiterGetDepth(arb, 0);
+	cpBodySetPosition(bMonkey, cpvadd(bMonkey->p, cpvmult(norm, dist-1)));
+	if (contact) contact->hit = hit, contact->norm = norm, contact->depth = dist;
+	cpVect off = cpv(0, 3);
+	cpPinJointInit(&owner->joints[0], bMonkey, bTree,         off, cpBodyWorldToLocal(bTree, cpvadd(hit, off)));
+	cpPinJointInit(&owner->joints[1], bMonkey, bTree, cpvneg(off), cpBodyWorldToLocal(bTree, cpvsub(hit, off)));
+	if (!owner->grabbing) owner->grabbing = true, w.grabs[w.grabCount++] = owner; //a second grab in the same step replaces the first
+	return impact;
+}
+
+//Grabs in all worlds are counted, only the ones in the game world are logged and make sounds
+static void CollisionMonkeyImpl(cpArbiter *arb, cpSpace *space)
+{
+	sWorld& w = *GetWorld(space);
+	if (w.tipped) return; //monkeys that let go fall off instead of grabbing the tree again
+	sGrabContact contact;
+	float impact = AttachMonkey(arb, space, &contact);
+	if (impact < 0) return;
+	w.monkeys++;
+	if (&w != &game) return;
+	Telemetry.Grab(contact.hit, contact.norm, contact.depth, impact);
+	if (!headless)
+	{
+		sSimEvent e = { SIMEVT_GRAB, w.monkeys };
+		e.impact = impact;
+		simEvents.Push(e);
+	}
+}
+
+static cpBool CollisionMonkey(cpArbiter *arb, cpSpace *space, cpDataPointer userData)
+{
+	if (!timeCallbacks || GetWorld(space) != &game) { CollisionMonkeyImpl(arb, space); return cpTrue; }
+	double t = PerfTime();
+	CollisionMonkeyImpl(arb, space);
+	frameTimes.collision += PerfTime() - t;
+	return cpTrue;
+}
+
+//Empties a space for reuse, all objects in it are either pooled or static
+static void ClearSpaceObjects(cpSpace* space)
+{
+	while (space->sleepingComponents->num) cpBodyActivate((cpBody*)space->sleepingComponents->arr[0]); //sleeping bodies are not in the body lists
+	for (int i = space->constraints->num; i--;)
+		cpSpaceRemoveConstraint(space, (cpConstraint*)space->constraints->arr[i]);
+	for (int i = space->dynamicBodies->num; i--;)
+		RemoveBody(space, (cpBody*)space->dynamicBodies->arr[i]);
+	for (int i = space->staticBodies->num; i--;)
+		if (space->staticBodies->arr[i] != space->staticBody) RemoveBody(space, (cpBody*)space->staticBodies->arr[i]);
+	space->shapeIDCounter = 0; //shape hash ids influence the order of collision pairs
+}
+
+static cpVect ShapeVelocity(cpShape* shape) { return shape->body->v; }
+static void InsertShape(cpShape* shape, cpSpatialIndex* index) { cpSpatialIndexInsert(index, shape, shape->hashid); }
+
+//Switches the broadphase of a space between the default bounding box tree and a spatial hash, keeping all shapes
+static void SetBroadphase(cpSpace* space, bool hash)
+{
+	cpSpatialIndex *staticShapes, *dynamicShapes;
+	if (hash)
+	{
+		staticShapes = cpSpaceHashNew(HASH_CELL_SIZE, HASH_CELL_COUNT, (cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
+		dynamicShapes = cpSpaceHashNew(HASH_CELL_SIZE, HASH_CELL_COUNT, (cpSpatialIndexBBFunc)cpShapeGetBB, staticShapes);
+	}
+	else
+	{
+		staticShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
+		dynamicShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetBB, staticShapes);
+		cpBBTreeSetVelocityFunc(dynamicShapes, (cpBBTreeVelocityFunc)ShapeVelocity);
+	}
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)InsertShape, staticShapes);
+	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)InsertShape, dynamicShapes);
+	cpSpatialIndexFree(space->staticShapes);
+	cpSpatialIndexFree(space->dynamicShapes);
+	space->staticShapes = staticShapes;
+	space->dynamicShapes = dynamicShapes;
+}
+
+//Creates the space of a world and its monkey pool, neither is ever reallocated so the world must stay in place
+static void InitWorld(sWorld& w, int poolSize)
+{
+	cpSpace* space = w.space = cpSpaceNew();
+	allocStats.spaceAllocs++;
+	cpSpaceSetUserData(space, &w);
+	cpSpaceSetGravity(space, cpv(0.0f, -98.7f));
+	cpSpaceAddCollisionHandler(space, COLLISION_MONKEY, COLLISION_TREE)->beginFunc = CollisionMonkey;
+	cpSpaceAddCollisionHandler(space, COLLISION_MONKEY, COLLISION_MONKEY)->beginFunc = CollisionMonkey;
+	w.pool.resize(poolSize);
+	InitMonkeyPool(w);
+	w.quality = QUALITY_START;
+	cpSpaceSetIterations(space, qualityLevels[w.quality].iterations);
+}
+
+//Adds the hill and the tree standing upright to an empty space
+enum { TREE_MASS = 50 };
+static cpBody* AddWorldBase(cpSpace* space, sWorldBase& w, bool trunk = true)
+{
+	cpBody *b = cpSpaceAddBody(space, cpBodyInit(&w.hill, 0, 0));
+	cpBodySetType(b, CP_BODY_TYPE_STATIC);
+	cpBodySetPosition(b, cpv(0, -100));
+	cpShape *shape = cpSpaceAddShape(space, cpBoxShapeInit(&w.hillShape, b, 50, 200, 0));
+	cpShapeSetFriction(shape, 1);
+
+	cpBody* tree = cpSpaceAddBody(space, cpBodyInit(&w.tree, TREE_MASS, cpMomentForCircle(TREE_MASS, 0, 50, cpvzero)));
+	cpBodySetPosition(tree, cpv(0, 100));
+	shape = cpSpaceAddShape(space, cpBoxShapeInit2(&w.treeShapes[0], tree, cpBBNew( -10, -100,  10,  100), 0)); cpShapeSetCollisionType(shape, COLLISION_TREE);
+	shape = cpSpaceAddShape(space, cpBoxShapeInit2(&w.treeShapes[1], tree, cpBBNew(-70,  100, 70,  130), 0)); cpShapeSetCollisionType(shape, COLLISION_TREE);
+	if (!trunk) return tree;
+	cpConstraint* joint = cpPivotJointInit(&w.trunk, tree, space->staticBody, cpBodyWorldToLocal(tree, cpv(0, 1)), cpBodyWorldToLocal(space->staticBody, cpv(0, 1)));
+	cpConstraintSetMaxForce(joint, 1000);
+	cpSpaceAddConstraint(space, joint);
+	if (holdTreeUpright) cpSpaceAddConstraint(space, cpRotaryLimitJointInit(&w.upright, tree, space->staticBody, -.3f, .3f));
+	return tree;
+}
+
+//Empties a world for reuse and applies the current broadphase and sleep settings to it
+static void ClearWorld(sWorld& w)
+{
+	ClearSpaceObjects(w.space);
+	w.grabCount = 0; //never add joints queued for objects of the old world
+	while (!w.bodies.empty())
+		ReleaseMonkey(w, (sMonkey*)cpBodyGetUserData(w.bodies.back()));
+	InitMonkeyPool(w); //restore pool order for determinism
+	if (w.hashed != spatialHash) SetBroadphase(w.space, (w.hashed = spatialHash));
+	cpSpaceSetSleepTimeThreshold(w.space, (sleeping ? .5f : (cpFloat)INFINITY));
+}
+
+//Sets up a fresh game in a world with only the hill and the upright tree
+static void ResetWorld(sWorld& w)
+{
+	ClearWorld(w);
+	w.tree = AddWorldBase(w.space, w.base);
+	w.treePrevP = cpBodyGetPosition(w.tree), w.treePrevA = w.tree->a;
+	w.step = 0, w.monkeys = 0;
+	w.tipped = false;
+}
+
+static void ApplyQuality(sWorld& w, int level)
+{
+	w.quality = (level < QUALITY_LEVELS ? level : QUALITY_START);
+	cpSpaceSetIterations(w.space, qualityLevels[w.quality].iterations);
+	for (int i = 0; i != w.space->constraints->num; i++)
+	{
+		cpConstraint* c = (cpConstraint*)w.space->constraints->arr[i];
+		if (cpConstraintIsPinJoint(c)) cpConstraintSetErrorBias(c, JointErrorBias(w.quality));
+	}
+}
+
+//The governor picks a quality level that keeps the physics step time inside the budget of the preset
+//It never goes above the start level so the physics only differ from the regular game while over budget
+//It never trades away stability for speed: while joints stretch or the tree jitters beyond the bounds it only goes up in quality
+//Its decisions are recorded as replay inputs so replays and headless runs reproduce them exactly
+struct sQualityPreset { const char* name; int best, cheapest; double budgetMs; float maxJointError, maxJitter; };
+static const sQualityPreset qualityPresets[] = { { "desktop", QUALITY_START, 3, 4, 2, .05f }, { "web", QUALITY_START, 4, 2.5, 4, .1f } };
+#ifdef SIM_THREAD_SUPPORT
+static const sQualityPreset* qualityPreset = &qualityPresets[0]; //NULL keeps the start level
+#else
+static const sQualityPreset* qualityPreset = &qualityPresets[1];
+#endif
+static struct sQualityStats { double stepMs; float jointError, jitter; cpFloat lastW; int cooldown; } qualityStats; //running averages
+
+static int UpdateQualityGovernor()
+{
+	enum { COOLDOWN_FRAMES = 30 };
+	sQualityStats& q = qualityStats;
+	const sQualityPreset& p = *qualityPreset;
+	float jointError = 0;
+	for (int i = 0; i != game.space->constraints->num; i++)
+	{
+		cpConstraint* c = (cpConstraint*)game.space->constraints->arr[i];
+		if (!cpConstraintIsPinJoint(c)) continue;
+		cpPinJoint* j = (cpPinJoint*)c;
+		float err = (float)cpfabs(cpvdist(cpBodyLocalToWorld(c->a, j->anchorA), cpBodyLocalToWorld(c->b, j->anchorB)) - j->dist);
+		if (err > jointError) jointError = err;
+	}
+	q.stepMs += (frameTimes.step * 1000 / frameTimes.steps - q.stepMs) * .1;
+	q.jointError += (jointError - q.jointError) * .1f;
+	q.jitter += ((float)cpfabs(game.tree->w - q.lastW) / frameTimes.steps - q.jitter) * .1f;
+	q.lastW = game.tree->w;
+	if (q.cooldown) { q.cooldown--; return game.quality; }
+
+	bool unstable = (q.jointError > p.maxJointError || q.jitter > p.maxJitter);
+	int level = game.quality;
+	if (q.stepMs > p.budgetMs && !unstable) level++;
+	else if (q.stepMs < p.budgetMs * .5 || (unstable && q.stepMs < p.budgetMs)) level--;
+	level = (level < p.best ? p.best : (level > p.cheapest ? p.cheapest : level));
+	if (level != game.quality) q.cooldown = COOLDOWN_FRAMES;
+	return level;
+}
+
+static void Reset(unsigned int seed)
+{
+	if (!game.space) InitWorld(game, MONKEY_POOL_SIZE);
+	ResetWorld(game);
+	ApplyQuality(game, QUALITY_START);
+	qualityStats.lastW = 0, qualityStats.cooldown = 0;
+
+	simSeed = seed;
+	game.rand.Seed(seed);
+	if (!replayPlaying) replayInputs.clear();
+	replayPos = 0;
+	replayInvalid = false;
+	rewindCount = 0;
+	stableWorld.clear();
+}
+
+static unsigned int NewSeed()
+{
+	if (fixedSeed) return fixedSeed;
+	static sRandom seeds;
+	if (!seeds.state) seeds.Seed((unsigned int)time(NULL));
+	return seeds.Next();
+}
+
+static void NewSky(unsigned int seed)
+{
+	sRandom r;
+	r.Seed(seed ^ 0x5BD1E995);
+	sky[0] = ZLRGB( r.Range(.0, .4),  r.Range(.0, .4), r.Range(.4, .8) );
+	sky[1] = ZLRGB( r.Range(.0, .4),  r.Range(.0, .4), r.Range(.4, .8) );
+	sky[2] = ZLRGB( r.Range(.0, .4),  r.Range(.0, .4), r.Range(.4, .8) );
+	sky[3] = ZLRGB( r.Range(.0, .4),  r.Range(.0, .4), r.Range(.4, .8) );
+}
+
+//All sprites are packed tightly into one texture from Assets/ by tools/pack_atlas.py, so drawing never switches textures
+//Each sprite is clipped to its own pixel rect (from the top left of the image), the tool rewrites the table after packing
+enum AtlasSpriteIndex { ATLAS_TREE, ATLAS_LOGO, ATLAS_HILL, ATLAS_MONKEY, ATLAS_COUNT };
+struct sAtlasRect { int x, y, w, h; };
+static const sAtlasRect atlasRects[ATLAS_COUNT] = { { 0, 0, 512, 512 }, { 514, 0, 640, 368 }, { 514, 370, 256, 256 }, { 772, 370, 128, 128 } };
+static ZL_Surface AtlasSprite(const ZL_Surface& atlas, AtlasSpriteIndex sprite)
+{
+	const sAtlasRect& r = atlasRects[sprite];
+	ZL_Surface srf = atlas.Clone();
+	srf.SetClipping(ZL_Rect(r.x, r.y, r.x + r.w, r.y + r.h));
+	return srf;
+}
+
+//Audio rendered offline from the IMC tables replaces the live synthesizer when it is found in the data directory
+//Files are named by a hash of the song tables so a bake that no longer matches the song is ignored
+static ZL_String BakedAudioPath(const char* name, const TImcSongData* song)
+{
+	return ZL_String::format("Data/%s-%08x.ogg", name, HashImcSong(song));
+}
+
+static bool HasBakedAudio(const char* name, const TImcSongData* song)
+{
+	return !liveAudio && ZL_File::Exists(BakedAudioPath(name, song).c_str());
+}
+
+//All sound effects play through a fixed set of voices, each effect owns a few loaded copies that are reused oldest first
+//A ZL_Sound copy shares the playback position of the original and playing it again restarts it, so overlapping voices
+//need their own loaded sounds. The source is resolved once per effect and the effects are short single row songs
+//Plays of an effect within one frame are merged into a single play at the loudest requested volume
+enum SoundEffect { SFX_GRAB, SFX_THROW, SFX_GAMEOVER, SFX_COUNT };
+static struct sSoundEffects
+{
+	enum { MAX_VOICES = 4 };
+	struct sEffect { ZL_Sound voices[MAX_VOICES]; int voiceCount, next, requests; float volume; } effects[SFX_COUNT];
+
+	void Load(SoundEffect fx, const char* name, TImcSongData* song, int voiceCount)
+	{
+		sEffect& e = effects[fx];
+		ZL_String baked = (HasBakedAudio(name, song) ? BakedAudioPath(name, song) : ZL_String());
+		for (e.voiceCount = 0; e.voiceCount != voiceCount && e.voiceCount != MAX_VOICES; e.voiceCount++)
+			e.voices[e.voiceCount] = (baked.length() ? ZL_Sound(baked.c_str()) : ZL_SynthImcTrack::LoadAsSample(song));
+	}
+
+	void Play(SoundEffect fx, float volume = 1)
+	{
+		sEffect& e = effects[fx];
+		e.requests++;
+		if (volume > e.volume) e.volume = volume;
+	}
+
+	void Flush()
+	{
+		for (int i = 0; i != SFX_COUNT; i++)
+		{
+			sEffect& e = effects[i];
+			if (!e.requests) continue;
+			if (e.voiceCount)
+			{
+				ZL_Sound& voice = e.voices[e.next];
+				e.next = (e.next + 1) % e.voiceCount;
+				voice.SetVolume(ZL_Math::Clamp01(e.volume));
+				voice.Play();
+			}
+			e.requests = 0, e.volume = 0;
+		}
+	}
+} SoundEffects;
+
+static void Init()
+{
+	fntMain = ZL_Font("Data/matchbox.ttf.zip", 52);
+	ZL_Surface atlas("Data/atlas.png");
+	srfHill   = AtlasSprite(atlas, ATLAS_HILL).SetOrigin(ZL_Origin::Center).SetScale(.5f);
+	srfTree   = AtlasSprite(atlas, ATLAS_TREE).SetOrigin(ZL_Origin::Center).SetScale(.55f);
+	srfMonkey = AtlasSprite(atlas, ATLAS_MONKEY).SetOrigin(ZL_Origin::Center).SetScale(.4f);
+	srfLogo   = AtlasSprite(atlas, ATLAS_LOGO).SetOrigin(ZL_Origin::Center);
+
+	if (HasBakedAudio("music", &imcDataIMCMUSIC)) (sndMusic = ZL_Sound(BakedAudioPath("music", &imcDataIMCMUSIC).c_str(), true)).Play(true);
+	else imcMusic.Play();
+	SoundEffects.Load(SFX_GRAB, "grab", &imcDataIMCGRAB, 4);
+	SoundEffects.Load(SFX_THROW, "throw", &imcDataIMCTHROW, 2);
+	SoundEffects.Load(SFX_GAMEOVER, "gameover", &imcDataIMCGAMEOVER, 1);
+
+	txtMonkeys = ZL_TextBuffer(fntMain);
+
+	unsigned int seed = NewSeed();
+	Reset(seed);
+	NewSky(seed);
+}
+
+static void InitMonkey(cpSpace* space, sMonkey* m, float side, float height, float range, float scale)
+{
+	cpBody *b = cpSpaceAddBody(space, cpBodyInit(&m->body, 3*scale, cpMomentForCircle(3*scale, 0, 5*scale, cpvzero)));
+	cpBodySetPosition(b, cpv(300*side, height));
+	m->prevP = b->p, m->prevA = b->a, m->flip = (side < 0);
+	cpBodySetUserData(b, m);
+	cpShape* shape = cpSpaceAddShape(space, cpCircleShapeInit(&m->shape, b, 12*scale, cpvzero));
+	cpShapeSetCollisionType(shape, COLLISION_MONKEY);
+	cpShapeSetFilter(shape, filterMonkey);
+	cpBodySetVelocity(b, cpv((100.f + range * 200.f) * -side, 0));
+}
+
+static void SpawnMonkey(sWorld& w, float side, float height, float range)
+{
+	float scale = w.rand.Range(.8f, 1.25f);
+	sMonkey* m = TakeMonkey(w);
+	if (m) InitMonkey(w.space, m, side, height, range, scale);
+}
+
+//Runs between steps so bodies are removed right away, a queued post step removal would outlive a reset or restore of the pool
+//Every removal searches the body array and filters the contact cache, so after the tree tipped over
+//the falling crowd is removed a chunk per step while it is out of sight below the hill
+enum { REMOVE_FALLEN_PER_STEP = 64 };
+static void RemoveFallenMonkeys(sWorld& w)
+{
+	for (size_t i = w.bodies.size(), n = 0; i-- && n != REMOVE_FALLEN_PER_STEP;) //releasing moves the last monkey into slot i
+	{
+		sMonkey* m = (sMonkey*)cpBodyGetUserData(w.bodies[i]);
+		if (m->body.p.y >= -200.f || m->baked) continue;
+		RemoveBody(w.space, &m->body);
+		ReleaseMonkey(w, m);
+		n++;
+	}
+}
+
+static void GetMonkeyTransform(const sWorld& w, sMonkey* m, cpVect& p, cpFloat& a)
+{
+	if (m->baked) p = cpBodyLocalToWorld(w.tree, m->bakedOffset), a = w.tree->a + m->bakedAngle;
+	else p = m->body.p, a = m->body.a;
+}
+
+static void SavePrevTransforms(sWorld& w)
+{
+	w.treePrevP = cpBodyGetPosition(w.tree), w.treePrevA = w.tree->a;
+	for (size_t i = 0; i != w.bodies.size(); i++)
+	{
+		sMonkey* m = (sMonkey*)cpBodyGetUserData(w.bodies[i]);
+		GetMonkeyTransform(w, m, m->prevP, m->prevA);
+	}
+}
+
+//Turns a monkey hanging on the tree into an extra circle shape of the tree body, moving the tree's
+//center of gravity and moment so it still tips the same way, and re-hangs monkeys that held onto it
+static void BakeMonkey(sWorld& w, sMonkey* m)
+{
+	cpBody* body = &m->body;
+	static thread_local std::vector<cpConstraint*> holders; //arena worlds bake in parallel
+	holders.clear();
+	CP_BODY_FOREACH_CONSTRAINT(body, c) if (c != &m->joints[0].constraint && c != &m->joints[1].constraint) holders.push_back(c);
+	for (size_t i = 0; i != holders.size(); i++)
+	{
+		cpPinJoint* j = (cpPinJoint*)holders[i];
+		bool holderIsA = (j->constraint.b == body);
+		cpBody* holder = (holderIsA ? j->constraint.a : j->constraint.b);
+		cpVect anchorHolder = (holderIsA ? j->anchorA : j->anchorB);
+		cpVect grip = cpBodyLocalToWorld(body, (holderIsA ? j->anchorB : j->anchorA));
+		cpSpaceRemoveConstraint(w.space, &j->constraint);
+		cpPinJointInit(j, holder, w.tree, anchorHolder, cpBodyWorldToLocal(w.tree, grip));
+		AddJoint(w, &j->constraint);
+	}
+
+	cpFloat mass = cpBodyGetMass(body), moment = cpBodyGetMoment(body), r = m->shape.r;
+	m->bakedOffset = cpBodyWorldToLocal(w.tree, body->p);
+	m->bakedAngle = body->a - w.tree->a;
+	RemoveBody(w.space, body);
+
+	cpFloat treeMass = cpBodyGetMass(w.tree), newMass = treeMass + mass;
+	cpVect cog = cpBodyGetCenterOfGravity(w.tree), newCog = cpvlerp(cog, m->bakedOffset, mass / newMass);
+	cpFloat newMoment = cpBodyGetMoment(w.tree) + treeMass * cpvdistsq(cog, newCog) + moment + mass * cpvdistsq(m->bakedOffset, newCog);
+	cpVect origin = cpBodyGetPosition(w.tree), treeVel = cpBodyGetVelocityAtLocalPoint(w.tree, newCog);
+	cpBodySetMass(w.tree, newMass);
+	cpBodySetMoment(w.tree, newMoment);
+	cpBodySetCenterOfGravity(w.tree, newCog);
+	cpBodySetPosition(w.tree, origin);
+	cpBodySetVelocity(w.tree, treeVel);
+
+	cpShape* shape = cpSpaceAddShape(w.space, cpCircleShapeInit(&m->shape, w.tree, r, m->bakedOffset));
+	cpShapeSetCollisionType(shape, COLLISION_TREE);
+	m->baked = true;
+}
+
+static void BakeSettledMonkeys(sWorld& w)
+{
+	for (size_t i = 0; i != w.bodies.size(); i++)
+	{
+		sMonkey* m = (sMonkey*)cpBodyGetUserData(w.bodies[i]);
+		if (m->baked) continue;
+		cpConstraint* j = &m->joints[0].constraint;
+		if (j->space != w.space || (j->a != w.tree && j->b != w.tree)) { m->settleSteps = 0; continue; }
+		cpVect relVel = cpvsub(m->body.v, cpBodyGetVelocityAtWorldPoint(w.tree, m->body.p));
+		if (cpvlengthsq(relVel) > 5*5 || cpfabs(m->body.w - w.tree->w) > .5f) m->settleSteps = 0;
+		else if (++m->settleSteps == 30) BakeMonkey(w, m);
+	}
+}
+
+//Turns all baked monkeys back into bodies of their own moving along with the tree and gives the tree its own mass back
+//Used once the tree tipped over so the monkeys welded to it let go and fall off like the hanging ones
+static void UnbakeMonkeys(sWorld& w)
+{
+	bool any = false;
+	cpVect origin = cpBodyGetPosition(w.tree);
+	for (size_t i = 0; i != w.bodies.size(); i++)
+	{
+		sMonkey* m = (sMonkey*)cpBodyGetUserData(w.bodies[i]);
+		if (!m->baked) continue;
+		cpVect p = cpBodyLocalToWorld(w.tree, m->bakedOffset);
+		cpFloat r = m->shape.r;
+		cpSpaceRemoveShape(w.space, &m->shape.shape);
+		cpBody* b = cpSpaceAddBody(w.space, &m->body);
+		cpBodySetAngle(b, w.tree->a + m->bakedAngle);
+		cpBodySetPosition(b, p);
+		cpBodySetVelocity(b, cpBodyGetVelocityAtWorldPoint(w.tree, p));
+		cpBodySetAngularVelocity(b, w.tree->w);
+		cpShape* shape = cpSpaceAddShape(w.space, cpCircleShapeInit(&m->shape, b, r, cpvzero));
+		cpShapeSetCollisionType(shape, COLLISION_MONKEY);
+		cpShapeSetFilter(shape, filterMonkey);
+		m->baked = m->loose = false, m->settleSteps = 0;
+		any = true;
+	}
+	if (!any) return;
+	cpVect treeVel = cpBodyGetVelocityAtWorldPoint(w.tree, origin);
+	cpBodySetMass(w.tree, TREE_MASS);
+	cpBodySetMoment(w.tree, cpMomentForCircle(TREE_MASS, 0, 50, cpvzero));
+	cpBodySetCenterOfGravity(w.tree, cpvzero);
+	cpBodySetPosition(w.tree, origin);
+	cpBodySetVelocity(w.tree, treeVel);
+}
+
+//Monkeys outside of everything that hangs on the tree and moving further away can never reach it again
+//These only keep colliding with the hill and tree so they skip the narrowphase and callbacks against other monkeys
+static void FilterLooseMonkeys(sWorld& w)
+{
+	cpBB reach = cpShapeGetBB(w.tree->shapeList);
+	CP_BODY_FOREACH_SHAPE(w.tree, shape) reach = cpBBMerge(reach, cpShapeGetBB(shape));
+	for (size_t i = 0; i != w.bodies.size(); i++)
+		if (w.bodies[i]->constraintList) reach = cpBBMerge(reach, cpShapeGetBB(w.bodies[i]->shapeList));
+	reach = cpBBNew(reach.l - 50, reach.b - 50, reach.r + 50, reach.t + 50); //tree and monkeys swinging
+
+	for (size_t i = 0; i != w.bodies.size(); i++)
+	{
+		sMonkey* m = (sMonkey*)cpBodyGetUserData(w.bodies[i]);
+		if (m->baked || m->loose || m->body.constraintList) continue;
+		cpBB bb = cpShapeGetBB(&m->shape.shape);
+		cpVect v = m->body.v;
+		if ((bb.t < reach.b && v.y <= 0) || (bb.l > reach.r && v.x >= 0) || (bb.r < reach.l && v.x <= 0))
+		{
+			m->loose = true;
+			cpShapeSetFilter(&m->shape.shape, filterLoose);
+		}
+	}
+}
+
+//Plain copy of a body's state, applied onto a freshly initialized body it reproduces the body
+struct sBodyState { cpVect origin, v, cog; cpFloat a, w, mass, moment; };
+struct sMonkeyState { sBodyState body; cpFloat r; cpVect bakedOffset; cpFloat bakedAngle; int settleSteps; bool flip, baked, loose; };
+struct sJointState { int owner, slot, a, b; cpVect anchorA, anchorB; cpFloat dist; }; //bodies are monkey indices or -1 for the tree
+
+//A world snapshot is one contiguous buffer of plain data: this header, then all monkeys, then all joints
+struct sWorldHeader { sBodyState tree; unsigned int simStep, randState; int monkeys, monkeyCount, jointCount; bool trunk; };
+static const sWorldHeader& GetWorldHeader(const std::vector<unsigned char>& buf) { return *(const sWorldHeader*)&buf[0]; }
+static const sMonkeyState* GetWorldMonkeys(const std::vector<unsigned char>& buf) { return (const sMonkeyState*)(&buf[0] + sizeof(sWorldHeader)); }
+static const sJointState* GetWorldJoints(const std::vector<unsigned char>& buf) { return (const sJointState*)(GetWorldMonkeys(buf) + GetWorldHeader(buf).monkeyCount); }
+
+static sBodyState GetBodyState(cpBody* b)
+{
+	sBodyState s = { cpBodyGetPosition(b), b->v, b->cog, b->a, b->w, b->m, b->i };
+	return s;
+}
+
+static void SetBodyState(cpBody* b, const sBodyState& s)
+{
+	cpBodySetMass(b, s.mass);
+	cpBodySetMoment(b, s.moment);
+	cpBodySetCenterOfGravity(b, s.cog);
+	cpBodySetAngle(b, s.a);
+	cpBodySetPosition(b, s.origin);
+	cpBodySetVelocity(b, s.v);
+	cpBodySetAngularVelocity(b, s.w);
+}
+
+static int GetJointBodyIndex(const sWorld& w, cpBody* b)
+{
+	return (b == w.tree ? -1 : ((sMonkey*)cpBodyGetUserData(b))->index);
+}
+
+//Copies the tree, all monkeys and the joints between them into a snapshot buffer, only valid between steps
+//The buffer keeps its capacity so capturing into a reused buffer doesn't allocate once it is large enough
+static void CaptureWorld(const sWorld& w, std::vector<unsigned char>& buf)
+{
+	int monkeyCount = (int)w.bodies.size();
+	buf.resize(sizeof(sWorldHeader) + monkeyCount * (sizeof(sMonkeyState) + 2 * sizeof(sJointState)));
+	sWorldHeader& hdr = *(sWorldHeader*)&buf[0];
+	sMonkeyState* ms = (sMonkeyState*)(&buf[0] + sizeof(sWorldHeader));
+	sJointState* js = (sJointState*)(ms + monkeyCount);
+	hdr.tree = GetBodyState(w.tree);
+	hdr.simStep = w.step, hdr.randState = w.rand.state, hdr.monkeys = w.monkeys;
+	hdr.monkeyCount = monkeyCount, hdr.jointCount = 0;
+	hdr.trunk = (w.base.trunk.constraint.space == w.space);
+	for (int i = 0; i != monkeyCount; i++)
+	{
+		sMonkey* m = (sMonkey*)cpBodyGetUserData(w.bodies[i]);
+		sMonkeyState st = { GetBodyState(&m->body), m->shape.r, m->bakedOffset, m->bakedAngle, m->settleSteps, m->flip, m->baked, m->loose };
+		ms[i] = st;
+		for (int k = 0; k != 2; k++)
+		{
+			cpPinJoint* j = &m->joints[k];
+			if (j->constraint.space != w.space) continue;
+			sJointState jt = { i, k, GetJointBodyIndex(w, j->constraint.a), GetJointBodyIndex(w, j->constraint.b), j->anchorA, j->anchorB, j->dist };
+			js[hdr.jointCount++] = jt;
+		}
+	}
+	buf.resize(sizeof(sWorldHeader) + monkeyCount * sizeof(sMonkeyState) + hdr.jointCount * sizeof(sJointState));
+}
+
+//Rebuilds a captured world in place, all objects come from the pools of the world so nothing is allocated
+//Monkeys are taken in the captured order so their indices match the ones stored with the joints
+static void BuildWorld(sWorld& w, const std::vector<unsigned char>& buf)
+{
+	const sWorldHeader& hdr = GetWorldHeader(buf);
+	const sMonkeyState* monkeyStates = GetWorldMonkeys(buf);
+	const sJointState* jointStates = GetWorldJoints(buf);
+	cpSpace* space = w.space;
+	ClearWorld(w);
+	cpBody* tree = w.tree = AddWorldBase(space, w.base, hdr.trunk);
+	SetBodyState(tree, hdr.tree);
+	for (int i = 0; i != hdr.monkeyCount; i++)
+	{
+		const sMonkeyState& st = monkeyStates[i];
+		sMonkey* m = TakeMonkey(w);
+		m->flip = st.flip, m->baked = st.baked, m->loose = st.loose, m->settleSteps = st.settleSteps, m->bakedOffset = st.bakedOffset, m->bakedAngle = st.bakedAngle;
+		cpBodyInit(&m->body, st.body.mass, st.body.moment);
+		cpBodySetUserData(&m->body, m);
+		if (st.baked)
+		{
+			SetBodyState(&m->body, st.body);
+			cpShapeSetCollisionType(cpSpaceAddShape(space, cpCircleShapeInit(&m->shape, tree, st.r, st.bakedOffset)), COLLISION_TREE);
+			continue;
+		}
+		cpSpaceAddBody(space, &m->body);
+		SetBodyState(&m->body, st.body);
+		m->prevP = m->body.p, m->prevA = m->body.a;
+		cpShape* shape = cpSpaceAddShape(space, cpCircleShapeInit(&m->shape, &m->body, st.r, cpvzero));
+		cpShapeSetCollisionType(shape, COLLISION_MONKEY);
+		cpShapeSetFilter(shape, (st.loose ? filterLoose : filterMonkey));
+	}
+	for (int i = 0; i != hdr.jointCount; i++)
+	{
+		const sJointState& js = jointStates[i];
+		cpPinJoint* j = &((sMonkey*)cpBodyGetUserData(w.bodies[js.owner]))->joints[js.slot];
+		cpPinJointInit(j, (js.a < 0 ? tree : w.bodies[js.a]), (js.b < 0 ? tree : w.bodies[js.b]), js.anchorA, js.anchorB);
+		j->dist = js.dist;
+		AddJoint(w, &j->constraint);
+	}
+	SavePrevTransforms(w);
+	w.step = hdr.simStep, w.rand.state = hdr.randState, w.monkeys = hdr.monkeys;
+	w.tipped = false;
+}
+
+//Restores the game world from a snapshot
+//Contact caches are not part of a snapshot so a restored game can't be replayed bit-exactly and stops recording
+static void RestoreWorld(const std::vector<unsigned char>& buf)
+{
+	BuildWorld(game, buf);
+	while (!replayInputs.empty() && replayInputs.back().step >= game.step) replayInputs.pop_back();
+	replayInvalid = true;
+}
+
+//Every quarter second a snapshot goes into the rewind ring, the last one with a steady tree is kept for retrying
+static void UpdateRewind()
+{
+	unsigned int interval = (stepTicks < REWIND_INTERVAL_TICKS ? REWIND_INTERVAL_TICKS / stepTicks : 1);
+	if (headless || game.tipped || game.step % interval) return;
+	std::vector<unsigned char>& buf = rewindRing[rewindHead];
+	CaptureWorld(game, buf);
+	rewindHead = (rewindHead + 1) % REWIND_SLOTS;
+	if (rewindCount < REWIND_SLOTS) rewindCount++;
+	if (cpfabs(game.tree->a) < .15f && cpfabs(game.tree->w) < .1f) stableWorld = buf;
+}
+
+static bool Rewind(int slots)
+{
+	if (!rewindCount) return false;
+	int keep = (rewindCount > slots ? rewindCount - slots : 1);
+	rewindHead = (rewindHead - rewindCount + keep + REWIND_SLOTS) % REWIND_SLOTS;
+	rewindCount = keep;
+	RestoreWorld(rewindRing[(rewindHead + REWIND_SLOTS - 1) % REWIND_SLOTS]);
+	return true;
+}
+
+static bool RetryFromStable()
+{
+	if (stableWorld.empty()) return false;
+	RestoreWorld(stableWorld);
+	rewindCount = 0;
+	return true;
+}
+
+static sReplayInput QuantizeInput(unsigned int step, ReplayInputType type, float side = 0, float height = 0, float charge = 0)
+{
+	sReplayInput in = { step, (unsigned char)type, (signed char)(side < 0 ? -1 : 1), (unsigned short)(ZL_Math::Clamp(height, 50.f, 250.f) * 100 + .5f), (unsigned short)(ZL_Math::Clamp01(charge) * 65535 + .5f) };
+	return in;
+}
+
+static void ApplyInput(const sReplayInput& in)
+{
+	if (in.type == INPUT_THROW) SpawnMonkey(game, in.side, in.height / 100.f, in.charge / 65535.f);
+	else if (in.type == INPUT_IMPULSE)
+	{
+		cpBodyActivate(game.tree);
+		cpBodyApplyImpulseAtWorldPoint(game.tree, cpv(10000, 0), cpv(0, 200));
+	}
+	else if (in.type == INPUT_QUALITY) ApplyQuality(game, in.height);
+}
 
-extern ZL_SynthImcTrack imcMusic;
-extern TImcSongData imcDataIMCGRAB, imcDataIMCTHROW, imcDataIMCGAMEOVER;
-static ZL_Sound sndGrab, sndThrow, sndGameOver;
-static ZL_Font fntMain;
-static cpSpace *space;
-static cpBody *bodyTree;
-static ZL_Surface srfHill, srfTree, srfMonkey, srfLogo;
-static int monkeys;
-static ZL_TextBuffer txtMonkeys;
-static ZL_Color sky[4];
+static void ApplyReplayInputs()
+{
+	for (; replayPlaying && replayPos < replayInputs.size() && replayInputs[replayPos].step <= game.step; replayPos++)
+		ApplyInput(replayInputs[replayPos]);
+}
 
-enum CollisionTypes
+//Replay file: "SMCR", version (3 added quality inputs), flags (rigid attach, spatial hash, no loose filter, sleeping), step ticks (16 bit), seed, input count, then 10 bytes per input (all little endian)
+static bool SaveReplay(const char* path, unsigned int seed, const std::vector<sReplayInput>& inputs)
 {
-	COLLISION_NONE,
-	COLLISION_TREE,
-	COLLISION_MONKEY,
-};
+	FILE* f = fopen(path, "wb");
+	if (!f) return false;
+	unsigned char hdr[16] = { 'S', 'M', 'C', 'R', 3, (unsigned char)((rigidAttach ? 1 : 0) | (spatialHash ? 2 : 0) | (looseFilter ? 0 : 4) | (sleeping ? 8 : 0)), (unsigned char)stepTicks, (unsigned char)(stepTicks >> 8) };
+	Put32(hdr + 8, seed);
+	Put32(hdr + 12, (unsigned int)inputs.size());
+	fwrite(hdr, 16, 1, f);
+	for (size_t i = 0; i != inputs.size(); i++)
+	{
+		const sReplayInput& in = inputs[i];
+		unsigned char rec[10] = { 0, 0, 0, 0, in.type, (unsigned char)in.side, (unsigned char)in.height, (unsigned char)(in.height >> 8), (unsigned char)in.charge, (unsigned char)(in.charge >> 8) };
+		Put32(rec, in.step);
+		fwrite(rec, 10, 1, f);
+	}
+	fclose(f);
+	return true;
+}
 
-static void PostStepAddJoint(cpSpace *space, cpConstraint* joint, void* data)
+static bool LoadReplay(const char* path, unsigned int& seed, std::vector<sReplayInput>& inputs)
 {
-	cpConstraintSetErrorBias(joint, cpfpow(1.0f - 0.001f, 60.0f));
-	cpSpaceAddConstraint(space, joint);
+	FILE* f = fopen(path, "rb");
+	if (!f) return false;
+	unsigned char hdr[16], rec[10];
+	bool ok = (fread(hdr, 16, 1, f) == 1 && !memcmp(hdr, "SMCR", 4) && hdr[4] >= 1 && hdr[4] <= 3);
+	int ticks = (ok ? hdr[6] | (hdr[7] << 8) : 0);
+	ok = (ok && ticks >= MIN_STEP_TICKS && ticks <= MAX_STEP_TICKS); //a corrupt step length would stall or divide by zero
+	if (ok)
+	{
+		rigidAttach = (hdr[5] & 1) != 0;
+		spatialHash = (hdr[5] & 2) != 0;
+		sleeping = (hdr[5] & 8) != 0;
+		looseFilter = (hdr[4] > 1 && !(hdr[5] & 4)); //version 1 was recorded before loose monkeys were filtered
+		stepTicks = ticks;
+		seed = Get32(hdr + 8);
+		inputs.resize(Get32(hdr + 12));
+		for (size_t i = 0; ok && i != inputs.size(); i++)
+		{
+			ok = (fread(rec, 10, 1, f) == 1);
+			sReplayInput in = { Get32(rec), rec[4], (signed char)rec[5], (unsigned short)(rec[6] | (rec[7] << 8)), (unsigned short)(rec[8] | (rec[9] << 8)) };
+			inputs[i] = in;
+		}
+	}
+	fclose(f);
+	return ok;
 }
 
-static void PostStepRemoveBody(cpSpace *space, cpBody* body, void* data)
+//Removes the last constraints of a space in one pass, cpSpaceRemoveConstraint searches the array and the tree's
+//long constraint list for every single one. Each touched body gets its constraint list filtered once instead
+static void RemoveLastConstraints(cpSpace* space, int count)
 {
-	CP_BODY_FOREACH_SHAPE(body, shape) cpSpaceRemoveShape(space, shape);
-	CP_BODY_FOREACH_CONSTRAINT(body, constraint) cpSpaceRemoveConstraint(space, constraint);
-	cpSpaceRemoveBody(space, body);
+	static thread_local std::vector<cpBody*> touched; //arena worlds tip over in parallel
+	touched.clear();
+	cpArray* arr = space->constraints;
+	for (int i = arr->num - count; i != arr->num; i++)
+	{
+		cpConstraint* c = (cpConstraint*)arr->arr[i];
+		cpBodyActivate(c->a), cpBodyActivate(c->b);
+		c->space = NULL;
+		touched.push_back(c->a), touched.push_back(c->b);
+	}
+	arr->num -= count;
+	std::sort(touched.begin(), touched.end());
+	touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+	for (size_t i = 0; i != touched.size(); i++)
+	{
+		cpBody* body = touched[i];
+		for (cpConstraint** link = &body->constraintList; *link;)
+		{
+			cpConstraint* c = *link;
+			cpConstraint** next = (c->a == body ? &c->next_a : &c->next_b);
+			if (c->space) link = next;
+			else *link = *next;
+		}
+	}
 }
 
-static cpBool CollisionMonkey(cpArbiter *arb, cpSpace *space, cpDataPointer userData)
+//Once the tree tipped over the monkeys let go in chunks over the next steps so no single step removes thousands of joints
+enum { RELEASE_CONSTRAINTS_PER_STEP = 512 };
+
+static bool CheckTreeTipped(sWorld& w)
 {
-	CP_ARBITER_GET_BODIES(arb, bMonkey, bTree);
-	cpBodySetVelocity(bMonkey, cpvzero);
+	cpSpace* space = w.space;
+	bool tipped = (!w.tipped && sabs(w.tree->a) > 1 && space->constraints->num);
+	if (tipped) w.tipped = true, UnbakeMonkeys(w); //baked monkeys let go together with the joints
+	if (w.tipped && space->constraints->num)
+		RemoveLastConstraints(space, (space->constraints->num < RELEASE_CONSTRAINTS_PER_STEP ? space->constraints->num : RELEASE_CONSTRAINTS_PER_STEP));
+	return tipped;
+}
 
-	if (bMonkey->constraintList && bTree->constraintList) return cpTrue;
-	if (!bMonkey->constraintList && !bTree->constraintList) return cpTrue;
+static void StepSpace(sWorld& w, cpFloat dt)
+{
+	cpSpaceStep(w.space, dt);
+	AddGrabJoints(w);
+}
 
-	cpVect hit = (arb->swapped ? cpArbiterGetPointA(arb, 0) : cpArbiterGetPointB(arb, 0));
-	cpVect norm = cpArbiterGetNormal(arb); // takes swapped into account
-	float dist = cpArbiterGetDepth(arb, 0);
-	cpBodySetPosition(bMonkey, cpvadd(bMonkey->p, cpvmult(norm, dist-1)));
-	cpVect off = cpv(0, 3);
-	cpSpaceAddPostStepCallback(space, (cpPostStepFunc)PostStepAddJoint, cpPinJointNew(bMonkey, bTree,         off, cpBodyWorldToLocal(bTree, cpvadd(hit, off))), NULL);
-	cpSpaceAddPostStepCallback(space, (cpPostStepFunc)PostStepAddJoint, cpPinJointNew(bMonkey, bTree, cpvneg(off), cpBodyWorldToLocal(bTree, cpvsub(hit, off))), NULL);
+//One physics step of a world with everything that belongs to it, the game, the arena and the throw solver all step through here
+//Returns true in the step the tree tipped over
+static bool StepWorld(sWorld& w)
+{
+	const sQualityLevel& q = qualityLevels[w.quality];
+	for (int i = q.substeps; i--;) StepSpace(w, 2*stepTicks/s(1000) / q.substeps);
+	if (looseFilter) FilterLooseMonkeys(w);
+	if (rigidAttach) BakeSettledMonkeys(w);
+	w.step++;
+	RemoveFallenMonkeys(w);
+	return CheckTreeTipped(w);
+}
 
-	monkeys++;
-	txtMonkeys.SetText(ZL_String::format("%d", monkeys));
-	sndGrab.Play();
+//Assist mode: finds the throw with the best chance of a grab that keeps the tree steady by simulating each candidate
+//throw forward in its own copy of the world with StepWorld, so quality level, loose filter and rigid attach match the game
+//A solve runs in the background over the next simulation frames: in each frame every worker of the thread pool steps its
+//world for a slice of time, starting the next sample whenever one finishes, and the suggestion is sent once all are done
+enum { SOLVER_HEIGHTS = 9, SOLVER_CHARGES = 5, SOLVER_SCALES = 3, SOLVER_CANDIDATES = 2 * SOLVER_HEIGHTS * SOLVER_CHARGES, SOLVER_SAMPLES = SOLVER_CANDIDATES * SOLVER_SCALES, SOLVER_STEPS = 100, SOLVER_SLICE_MS = 4 };
+struct sSolverResult { float side, height, charge, grabChance, maxAngle; };
+struct sSolverWorld { sWorld world; sMonkey* thrown; int sample, steps; float maxAngle; }; //sample is -1 while idle
+static struct sSolver
+{
+	std::vector<sSolverWorld> worlds; //one per worker, never resized again, spaces point into the worlds
+	std::vector<unsigned char> capture; //the game world the solve started from
+	struct sSample { float maxAngle; bool grabbed; } samples[SOLVER_SAMPLES];
+	std::atomic<int> nextSample, finished;
+	double sliceEnd;
+	bool active;
+} Solver;
 
-	return cpTrue;
+static void GetSolverCandidate(int candidate, sSolverResult& res)
+{
+	int charge = candidate % SOLVER_CHARGES, height = (candidate / SOLVER_CHARGES) % SOLVER_HEIGHTS;
+	res.side = (candidate < SOLVER_CANDIDATES / 2 ? -1.f : 1.f);
+	res.height = 50.f + 200.f * height / (SOLVER_HEIGHTS - 1);
+	res.charge = charge / (float)(SOLVER_CHARGES - 1);
+	res.grabChance = res.maxAngle = 0;
 }
 
-static void Reset()
+static void SolverWork(int task, int worker, void*)
 {
-	if (space) cpSpaceFree(space);
-	space = cpSpaceNew();
-	cpSpaceSetGravity(space, cpv(0.0f, -98.7f));
-	cpSpaceAddCollisionHandler(space, COLLISION_MONKEY, COLLISION_TREE)->beginFunc = CollisionMonkey;
-	cpSpaceAddCollisionHandler(space, COLLISION_MONKEY, COLLISION_MONKEY)->beginFunc = CollisionMonkey;
+	sSolverWorld& sw = Solver.worlds[task];
+	do
+	{
+		if (sw.sample < 0)
+		{
+			int sample = Solver.nextSample.fetch_add(1);
+			if (sample >= SOLVER_SAMPLES) return;
+			sSolverResult c;
+			GetSolverCandidate(sample / SOLVER_SCALES, c);
+			BuildWorld(sw.world, Solver.capture);
+			sw.thrown = TakeMonkey(sw.world);
+			InitMonkey(sw.world.space, sw.thrown, c.side, c.height, c.charge, ZL_Math::Lerp(.8f, 1.25f, (sample % SOLVER_SCALES) / (float)(SOLVER_SCALES - 1))); //sample the range of random monkey sizes
+			sw.sample = sample, sw.steps = 0, sw.maxAngle = 0;
+		}
+		StepWorld(sw.world);
+		if (cpfabs(sw.world.tree->a) > sw.maxAngle) sw.maxAngle = (float)cpfabs(sw.world.tree->a);
+		if (++sw.steps != SOLVER_STEPS && sw.maxAngle <= 1) continue;
+		sSolver::sSample& s = Solver.samples[sw.sample];
+		s.maxAngle = sw.maxAngle, s.grabbed = (sw.thrown->body.constraintList || sw.thrown->baked);
+		sw.sample = -1;
+		Solver.finished++;
+	} while (PerfTime() < Solver.sliceEnd);
+}
 
-	cpBody *b = cpSpaceAddBody(space, cpBodyNewStatic());
-	cpBodySetPosition(b, cpv(0, -100));
-	cpShape *shape = cpSpaceAddShape(space, cpBoxShapeNew(b, 50, 200, 0));
-	cpShapeSetFriction(shape, 1);
+static void StartSolver()
+{
+	if (Solver.worlds.empty())
+	{
+		Solver.worlds.resize(ThreadPool.Workers());
+		for (size_t i = 0; i != Solver.worlds.size(); i++) InitWorld(Solver.worlds[i].world, 0);
+	}
+	CaptureWorld(game, Solver.capture);
+	size_t poolSize = GetWorldHeader(Solver.capture).monkeyCount + 1; //the captured monkeys and the thrown one
+	for (size_t i = 0; i != Solver.worlds.size(); i++)
+	{
+		sWorld& w = Solver.worlds[i].world;
+		Solver.worlds[i].sample = -1;
+		ApplyQuality(w, game.quality);
+		if (w.pool.size() >= poolSize) continue;
+		ClearWorld(w); //nothing may point into the pool while it moves in memory
+		w.pool.resize(poolSize);
+		InitMonkeyPool(w);
+	}
+	Solver.nextSample = 0, Solver.finished = 0;
+	Solver.active = true;
+}
+
+//Advances a running solve by one time slice, returns true with the best throw once all samples are done
+static bool StepSolver(sSolverResult& best)
+{
+	Solver.sliceEnd = PerfTime() + SOLVER_SLICE_MS / 1000.0;
+	ThreadPool.Run((int)Solver.worlds.size(), SolverWork, NULL);
+	if (Solver.finished != SOLVER_SAMPLES) return false;
+	Solver.active = false;
+
+	float bestScore = -1;
+	for (int i = 0; i != SOLVER_CANDIDATES; i++)
+	{
+		sSolverResult r;
+		GetSolverCandidate(i, r);
+		for (int j = 0; j != SOLVER_SCALES; j++)
+		{
+			const sSolver::sSample& s = Solver.samples[i * SOLVER_SCALES + j];
+			if (s.grabbed) r.grabChance += 1.f / SOLVER_SCALES;
+			if (s.maxAngle > r.maxAngle) r.maxAngle = s.maxAngle;
+		}
+		if (r.maxAngle > 1) continue; //tips the tree over
+		float score = r.grabChance * (1 - r.maxAngle);
+		if (score > bestScore) best = r, bestScore = score;
+	}
+	return bestScore >= 0;
+}
 
-	float treemass = 50;
-	bodyTree = cpSpaceAddBody(space, cpBodyNew(treemass, cpMomentForCircle(treemass, 0, 50, cpvzero)));
-	cpBodySetPosition(bodyTree, cpv(0, 100));
-	shape = cpSpaceAddShape(space, cpBoxShapeNew2(bodyTree, cpBBNew( -10, -100,  10,  100), 0)); cpShapeSetCollisionType(shape, COLLISION_TREE);
-	shape = cpSpaceAddShape(space, cpBoxShapeNew2(bodyTree, cpBBNew(-70,  100, 70,  130), 0)); cpShapeSetCollisionType(shape, COLLISION_TREE);
-	cpConstraint* trunk = cpPivotJointNew(bodyTree, space->staticBody, cpv(0, 1));
-	cpConstraintSetMaxForce(trunk, 1000);
-	cpSpaceAddConstraint(space, trunk);
+//Arena mode runs many independent trees side by side, each with an automatic thrower for demos and soak tests
+//Every world steps exactly like the game at the game's quality level and is stepped as one task on the thread pool
+enum { ARENA_MONKEYS = 256, ARENA_THROW_STEPS = 20, ARENA_SPACING_X = 700, ARENA_SPACING_Y = 500 };
+struct sArenaWorld { sWorld world; cpVect offset; };
+static std::vector<sArenaWorld> arenaWorlds;
+static int arenaSubSteps;
+static struct sArenaStats { double stepTime; int steps; } arenaStats; //of the last simulation frame
 
-	monkeys = 0;
-	txtMonkeys.SetText(ZL_String::format("%d", monkeys));
+static int GetArenaColumns()
+{
+	int cols = 1;
+	while (cols * cols < (int)arenaWorlds.size()) cols++;
+	return cols;
+}
 
-	sky[0] = ZLRGB( RAND_RANGE(.0, .4),  RAND_RANGE(.0, .4), RAND_RANGE(.4, .8) );
-	sky[1] = ZLRGB( RAND_RANGE(.0, .4),  RAND_RANGE(.0, .4), RAND_RANGE(.4, .8) );
-	sky[2] = ZLRGB( RAND_RANGE(.0, .4),  RAND_RANGE(.0, .4), RAND_RANGE(.4, .8) );
-	sky[3] = ZLRGB( RAND_RANGE(.0, .4),  RAND_RANGE(.0, .4), RAND_RANGE(.4, .8) );
+static void ResetArenaWorld(sWorld& w)
+{
+	ResetWorld(w);
+	ApplyQuality(w, game.quality);
 }
 
-static void Init()
+static void InitArena(int count)
 {
-	fntMain = ZL_Font("Data/matchbox.ttf.zip", 52);
-	srfHill   = ZL_Surface("Data/hill.png").SetOrigin(ZL_Origin::Center).SetScale(.5f);
-	srfTree   = ZL_Surface("Data/tree.png").SetOrigin(ZL_Origin::Center).SetScale(.55f);
-	srfMonkey = ZL_Surface("Data/monkey.png").SetOrigin(ZL_Origin::Center).SetScale(.4f);
-	srfLogo   = ZL_Surface("Data/logo.png").SetOrigin(ZL_Origin::Center);
+	arenaWorlds.resize(count); //never resized again, spaces point into the worlds
+	int cols = GetArenaColumns();
+	for (int i = 0; i != count; i++)
+	{
+		sWorld& w = arenaWorlds[i].world;
+		InitWorld(w, ARENA_MONKEYS);
+		w.rand.Seed(simSeed + i * 0x9E3779B9);
+		arenaWorlds[i].offset = cpv((i % cols - (cols - 1) * .5f) * ARENA_SPACING_X, -(i / cols) * ARENA_SPACING_Y);
+		ResetArenaWorld(w);
+	}
+}
+
+static void StepArenaWorld(int task, int worker, void*)
+{
+	sWorld& w = arenaWorlds[task].world;
+	if (w.quality != game.quality) ApplyQuality(w, game.quality);
+	for (int n = arenaSubSteps; n; n--)
+	{
+		if (n == 1) SavePrevTransforms(w);
+		if (!(w.step % ARENA_THROW_STEPS))
+		{
+			float side = ((w.rand.Next() & 1) ? 1.f : -1.f), height = w.rand.Range(50, 250), charge = w.rand.Range(0, 1);
+			SpawnMonkey(w, side, height, charge);
+		}
+		if (StepWorld(w)) ResetArenaWorld(w);
+	}
+}
 
-	imcMusic.Play();
-	sndGrab = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCGRAB);
-	sndThrow = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCTHROW);
-	sndGameOver = ZL_SynthImcTrack::LoadAsSample(&imcDataIMCGAMEOVER);
+static void StepArena(int steps)
+{
+	if (!steps) return;
+	double t = PerfTime();
+	arenaSubSteps = steps;
+	ThreadPool.Run((int)arenaWorlds.size(), StepArenaWorld, NULL);
+	arenaStats.stepTime = PerfTime() - t, arenaStats.steps = steps;
+}
 
-	txtMonkeys = ZL_TextBuffer(fntMain);
+static void PublishSnapshot(ticks_t accum)
+{
+	sSnapshot& snap = snapshots[snapshotWrite];
+	if (snap.list.capacity() < MONKEY_POOL_SIZE) snap.list.reserve(MONKEY_POOL_SIZE);
+	const cpSpace* space = game.space;
+	snap.treePrevP = game.treePrevP, snap.treeP = cpBodyGetPosition(game.tree);
+	snap.treePrevA = (float)game.treePrevA, snap.treeA = (float)game.tree->a;
+	snap.monkeys = game.monkeys;
+	#ifdef ZILLALOG
+	sProfileStats prof = { (float)(frameTimes.step * 1000), (float)(profTimes[PROF_POSTSTEP] * 1000), frameTimes.steps, space->dynamicBodies->num + space->staticBodies->num, space->arbiters->num, space->constraints->num, game.quality, spatialHash };
+	snap.prof = prof;
+	#endif
+	snap.time = ZL_Application::GetTicks(), snap.accum = accum;
+	snap.list.resize(game.bodies.size());
+	for (size_t i = 0; i != game.bodies.size(); i++)
+	{
+		sMonkey* m = (sMonkey*)cpBodyGetUserData(game.bodies[i]);
+		float size = m->shape.r / 12.f * srfMonkey.GetScaleW();
+		cpVect p; cpFloat a;
+		GetMonkeyTransform(game, m, p, a);
+		sSnapMonkey sm = { m->prevP, p, (float)m->prevA, (float)a, size * (m->flip ? -1 : 1), (float)m->shape.r * 2 };
+		snap.list[i] = sm;
+	}
+	if (!arenaWorlds.empty())
+	{
+		float size = srfMonkey.GetScaleW() / 12.f;
+		snap.arenaTrees.resize(arenaWorlds.size());
+		snap.arenaMonkeys.resize(arenaWorlds.size() * ARENA_MONKEYS);
+		snap.arenaMonkeyCount = 0;
+		for (size_t i = 0; i != arenaWorlds.size(); i++)
+		{
+			const sWorld& w = arenaWorlds[i].world;
+			cpVect offset = arenaWorlds[i].offset;
+			sSnapTree st = { cpvadd(w.treePrevP, offset), cpvadd(cpBodyGetPosition(w.tree), offset), (float)w.treePrevA, (float)w.tree->a };
+			snap.arenaTrees[i] = st;
+			for (size_t j = 0; j != w.bodies.size(); j++)
+			{
+				sMonkey* m = (sMonkey*)cpBodyGetUserData(w.bodies[j]);
+				cpVect p; cpFloat a;
+				GetMonkeyTransform(w, m, p, a);
+				sSnapMonkey sm = { cpvadd(m->prevP, offset), cpvadd(p, offset), (float)m->prevA, (float)a, (float)m->shape.r * size * (m->flip ? -1 : 1), (float)m->shape.r * 2 };
+				snap.arenaMonkeys[snap.arenaMonkeyCount++] = sm;
+			}
+		}
+		snap.arenaStepTime = arenaStats.stepTime, snap.arenaSteps = arenaStats.steps;
+	}
+	snapshotWrite = snapshotReady.exchange(snapshotWrite | SNAPSHOT_FRESH) & 3;
+}
+
+static const sSnapshot& AcquireSnapshot()
+{
+	if (snapshotReady.load() & SNAPSHOT_FRESH) snapshotRead = snapshotReady.exchange(snapshotRead) & 3;
+	return snapshots[snapshotRead];
+}
+
+//One step of the game with its replay inputs, timing and telemetry, shared by the frame loop and the headless runner
+static bool StepGame()
+{
+	ApplyReplayInputs();
+	double t = PerfTime();
+	bool tipped = StepWorld(game);
+	t = PerfTime() - t;
+	frameTimes.step += t, frameTimes.steps++, frameTimes.pairs += game.space->arbiters->num;
+	Telemetry.Step(game.step, game.tree, game.monkeys, game.space->constraints->num, t);
+	return tipped;
+}
+
+//Runs the commands queued by the game and the fixed timestep physics for the passed time
+//Rendering interpolates between the last two steps, catch-up steps are capped after a hitch
+//A snapshot is only published when the world changed, returns the ticks until the next step is due (0 while solving)
+static ticks_t SimFrame(ticks_t elapsed)
+{
+	double simStart = PerfTime();
+	frameTimes.step = frameTimes.collision = frameTimes.pairs = 0, frameTimes.steps = 0;
+	#ifdef ZILLALOG
+	profTimes[PROF_POSTSTEP] = 0;
+	#endif
+	static ticks_t TICKSUM = 0;
+	bool restored = false;
+	for (sSimCommand c; simCommands.Pop(c);)
+	{
+		if (c.type == SIMCMD_SOLVE) { StartSolver(); continue; }
+		Solver.active = false; //a suggestion for the world before this command would be stale
+		if (c.type == SIMCMD_RESET) { Reset(c.seed); TICKSUM = 0; restored = true; continue; }
+		if (replayPlaying) continue;
+		if (c.type == SIMCMD_BROADPHASE) { SetBroadphase(game.space, (game.hashed = (spatialHash ^= true))); replayInvalid = true; continue; }
+		if (c.type == SIMCMD_REWIND || c.type == SIMCMD_RETRY)
+		{
+			if (!(c.type == SIMCMD_REWIND ? Rewind(1000 / REWIND_INTERVAL_TICKS) : RetryFromStable())) continue;
+			sSimEvent e = { SIMEVT_RESTORED, game.monkeys };
+			simEvents.Push(e);
+			TICKSUM = 0;
+			restored = true;
+			continue;
+		}
+		sReplayInput in = QuantizeInput(game.step, c.type == SIMCMD_THROW ? INPUT_THROW : INPUT_IMPULSE, c.side, c.height, c.charge);
+		replayInputs.push_back(in);
+		ApplyInput(in);
+	}
+
+	TICKSUM += elapsed;
+	int substeps = (int)(TICKSUM / stepTicks);
+	if (substeps > maxSubSteps) { substeps = maxSubSteps; TICKSUM = substeps * stepTicks; }
+	for (TICKSUM -= substeps * stepTicks; substeps; substeps--)
+	{
+		if (substeps == 1) SavePrevTransforms(game);
+		if (StepGame())
+		{
+			sSimEvent e = { SIMEVT_GAMEOVER, game.monkeys };
+			simEvents.Push(e);
+			if (replayRecordPath && !replayPlaying && !replayInvalid) SaveReplay(replayRecordPath, simSeed, replayInputs);
+		}
+		UpdateRewind();
+	}
+	if (qualityPreset && !replayPlaying && frameTimes.steps)
+	{
+		int level = UpdateQualityGovernor();
+		if (level != game.quality)
+		{
+			sReplayInput in = { game.step, INPUT_QUALITY, 0, (unsigned short)level, 0 };
+			replayInputs.push_back(in);
+			ApplyInput(in);
+		}
+	}
+	if (!arenaWorlds.empty() && frameTimes.steps) StepArena(frameTimes.steps);
+	sSolverResult r;
+	if (Solver.active && StepSolver(r))
+	{
+		sSimEvent e = { SIMEVT_SUGGESTION, game.monkeys, r.side, r.height, r.charge, r.grabChance };
+		simEvents.Push(e);
+	}
+	if (frameTimes.steps || restored) PublishSnapshot(TICKSUM);
+	frameTimes.sim = PerfTime() - simStart;
+	return (Solver.active ? 0 : stepTicks - TICKSUM);
+}
+
+#ifdef SIM_THREAD_SUPPORT
+static struct sSimThread
+{
+	std::thread thread;
+	std::atomic<bool> running;
+
+	void Start()
+	{
+		running = true;
+		thread = std::thread([this]()
+		{
+			for (ticks_t last = ZL_Application::GetTicks(), now; running; last = now)
+			{
+				now = ZL_Application::GetTicks();
+				ticks_t wait = SimFrame(now - last);
+				if (wait) std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+			}
+		});
+	}
+
+	~sSimThread()
+	{
+		if (!thread.joinable()) return;
+		running = false;
+		thread.join();
+	}
+} SimThread;
+#endif
 
-	Reset();
+static void PostSimCommand(SimCommandType type, float side = 0, float height = 0, float charge = 0, unsigned int seed = 0)
+{
+	sSimCommand c = { type, side, height, charge, seed };
+	simCommands.Push(c);
 }
 
-static void DrawMonkey(cpBody *body, void *data)
+//All monkeys inside the view are submitted as one batch with a single draw call
+static void DrawMonkeys(const sSnapMonkey* list, size_t count, float alpha, const cpBB& view)
 {
-	if (body->shapeList->type != COLLISION_MONKEY) return;
+	PROFILE_SCOPE(PROF_DRAWMONKEYS);
+	srfMonkey.BatchRenderBegin(true);
+	for (size_t i = 0; i != count; i++)
+	{
+		const sSnapMonkey& m = list[i];
+		if (m.p.x + m.r < view.l || m.p.x - m.r > view.r || m.p.y + m.r < view.b || m.p.y - m.r > view.t) continue;
+		srfMonkey.Draw(cpvlerp(m.prevP, m.p, alpha), ZL_Math::Lerp(m.prevA, m.a, alpha), m.size, sabs(m.size));
+	}
+	srfMonkey.BatchRenderEnd();
+}
+
+//Bordered text gets rendered once into a texture per text buffer, scale, border and colors and is then drawn as a single quad
+struct sBakedText { const ZL_TextBuffer* buf; scalar scale; ZL_Color colfill, colborder; int border; ZL_Origin::Type origin; bool dirty; ZL_Surface srf; };
+static std::vector<sBakedText> bakedTexts;
+
+static bool SameColor(const ZL_Color& a, const ZL_Color& b) { return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a; }
 
-	float size = ((cpCircleShape*)body->shapeList)->r / 12.f * srfMonkey.GetScaleW();
-	srfMonkey.Draw(body->p, body->a, size * (cpBodyGetUserData(body) ? -1 : 1), size);
+static void SetBakedText(ZL_TextBuffer& buf, const char* text)
+{
+	buf.SetText(text);
+	for (size_t i = 0; i != bakedTexts.size(); i++) if (bakedTexts[i].buf == &buf) bakedTexts[i].dirty = true;
+}
 
-	if (body->p.y < -200.f)
-		cpSpaceAddPostStepCallback(space, (cpPostStepFunc)PostStepRemoveBody, body, NULL);
+static ZL_Surface BakeText(const ZL_TextBuffer& buf, scalar scale, const ZL_Color& colfill, const ZL_Color& colborder, int border)
+{
+	ZL_Vector dim = buf.GetDimensions() * scale;
+	int w = (int)dim.x + border*2 + 2, h = (int)dim.y + border*2 + 2;
+	ZL_Surface srf(w, h, true);
+	srf.RenderToBegin(true);
+	for (int i = 0; i < 9; i++) if (i != 4) buf.Draw(w*.5f+(border*((i%3)-1)), h*.5f+(border*((i/3)-1)), scale, scale, colborder, ZL_Origin::Center);
+	buf.Draw(w*.5f, h*.5f, scale, scale, colfill, ZL_Origin::Center);
+	srf.RenderToEnd();
+	return srf;
 }
 
 static void DrawTextBordered(const ZL_TextBuffer& buf, const ZL_Vector& p, scalar scale = 1, const ZL_Color& colfill = ZLWHITE, const ZL_Color& colborder = ZLBLACK, int border = 2, ZL_Origin::Type origin = ZL_Origin::Center)
 {
-	for (int i = 0; i < 9; i++) if (i != 4) buf.Draw(p.x+(border*((i%3)-1)), p.y+(border*((i/3)-1)), scale, scale, colborder, origin);
-	buf.Draw(p.x, p.y, scale, scale, colfill, origin);
+	PROFILE_SCOPE(PROF_DRAWTEXT);
+	sBakedText* e = NULL;
+	for (size_t i = 0; i != bakedTexts.size() && !e; i++)
+	{
+		sBakedText& t = bakedTexts[i];
+		if (t.buf == &buf && t.scale == scale && t.border == border && t.origin == origin && SameColor(t.colfill, colfill) && SameColor(t.colborder, colborder)) e = &t;
+	}
+	if (!e)
+	{
+		sBakedText t = { &buf, scale, colfill, colborder, border, origin, true, ZL_Surface() };
+		bakedTexts.push_back(t);
+		e = &bakedTexts.back();
+	}
+	if (e->dirty)
+	{
+		e->srf = BakeText(buf, scale, colfill, colborder, border);
+		e->srf.SetOrigin(origin);
+		e->dirty = false;
+	}
+	e->srf.Draw(p);
+}
+
+//Immediate mode lines and shapes collected over a frame and drawn as a single sprite batch from a tiny shape texture
+//Lines and circle outlines are stretched white tiles, discs and arrow heads come from baked tiles, higher depth draws on top
+enum DebugTile { DEBUGTILE_SOLID, DEBUGTILE_DISC, DEBUGTILE_TRIANGLE, DEBUGTILE_COUNT, DEBUGTILE_SIZE = 32 };
+static struct sDebugBatch
+{
+	struct sPrim { ZL_Vector p; scalar angle, w, h, depth; ZL_Color color; int tile; };
+	std::vector<sPrim> prims; //kept across frames so it only grows
+	ZL_Surface srf;
+	bool baked;
+
+	void Add(int tile, const ZL_Vector& p, scalar angle, scalar w, scalar h, const ZL_Color& color, scalar depth)
+	{
+		sPrim q = { p, angle, w, h, depth, color, tile };
+		prims.push_back(q);
+	}
+	void Line(const ZL_Vector& a, const ZL_Vector& b, const ZL_Color& color, scalar width = 1, scalar depth = 0)
+	{
+		ZL_Vector d = b - a;
+		Add(DEBUGTILE_SOLID, (a + b) * .5f, d.GetAngle(), d.GetLength(), width, color, depth);
+	}
+	void Circle(const ZL_Vector& p, scalar r, const ZL_Color& color, scalar width = 1, scalar depth = 0)
+	{
+		enum { SEGMENTS = 12 };
+		for (int i = 0; i != SEGMENTS; i++) Line(p + ZL_Vector::FromAngle(PI2 * i / SEGMENTS) * r, p + ZL_Vector::FromAngle(PI2 * (i + 1) / SEGMENTS) * r, color, width, depth);
+	}
+	void Disc(const ZL_Vector& p, scalar r, const ZL_Color& color, scalar depth = 0)
+	{
+		Add(DEBUGTILE_DISC, p, 0, r * 2, r * 2, color, depth);
+	}
+	void Triangle(const ZL_Vector& tip, const ZL_Vector& base, scalar baseWidth, const ZL_Color& color, scalar depth = 0) //isosceles
+	{
+		ZL_Vector d = tip - base;
+		Add(DEBUGTILE_TRIANGLE, (tip + base) * .5f, d.GetAngle(), d.GetLength(), baseWidth, color, depth);
+	}
+
+	void Flush()
+	{
+		if (prims.empty()) return;
+		if (!baked)
+		{
+			srf = ZL_Surface(DEBUGTILE_SIZE * DEBUGTILE_COUNT, DEBUGTILE_SIZE, true);
+			srf.RenderToBegin(true);
+			ZL_Display::FillRect(0, 0, DEBUGTILE_SIZE, DEBUGTILE_SIZE, ZLWHITE);
+			ZL_Display::FillCircle(DEBUGTILE_SIZE * 1.5f, DEBUGTILE_SIZE * .5f, DEBUGTILE_SIZE * .5f - 1, ZLWHITE);
+			ZL_Display::DrawTriangle(ZLV(DEBUGTILE_SIZE * 2, 0), ZLV(DEBUGTILE_SIZE * 3, DEBUGTILE_SIZE * .5f), ZLV(DEBUGTILE_SIZE * 2, DEBUGTILE_SIZE), ZLWHITE, ZLWHITE);
+			srf.RenderToEnd();
+			srf.SetTilesetClipping(DEBUGTILE_COUNT, 1).SetOrigin(ZL_Origin::Center);
+			baked = true;
+		}
+		std::stable_sort(prims.begin(), prims.end(), [](const sPrim& a, const sPrim& b) { return a.depth < b.depth; });
+		srf.BatchRenderBegin(true);
+		for (size_t i = 0; i != prims.size(); i++)
+		{
+			const sPrim& q = prims[i];
+			srf.SetTilesetIndex(q.tile);
+			srf.Draw(q.p.x, q.p.y, q.angle, q.w / DEBUGTILE_SIZE, q.h / DEBUGTILE_SIZE, q.color);
+		}
+		srf.BatchRenderEnd();
+		prims.clear();
+	}
+} DebugBatch;
+
+//Number display assembled from ten digits baked on the first draw, changing the value never allocates or lays out text
+static struct sNumberHud
+{
+	ZL_Surface digits[10];
+	scalar advance[10];
+	int value;
+
+	void Draw(const ZL_Vector& p, scalar scale = 1, const ZL_Color& colfill = ZLWHITE, const ZL_Color& colborder = ZLBLACK, int border = 2)
+	{
+		PROFILE_SCOPE(PROF_DRAWTEXT);
+		if (!advance[0])
+		{
+			for (int i = 0; i != 10; i++)
+			{
+				char digit[2] = { (char)('0' + i), 0 };
+				ZL_TextBuffer buf(fntMain, digit);
+				digits[i] = BakeText(buf, scale, colfill, colborder, border);
+				digits[i].SetOrigin(ZL_Origin::Center);
+				advance[i] = buf.GetDimensions().x * scale;
+			}
+		}
+		int n = 0, list[10];
+		for (unsigned int v = (value < 0 ? 0 : value); !n || v; v /= 10) list[n++] = v % 10;
+		scalar width = 0;
+		for (int i = 0; i != n; i++) width += advance[list[i]];
+		for (scalar x = p.x - width * .5f; n--; x += advance[list[n]]) digits[list[n]].Draw(x + advance[list[n]] * .5f, p.y);
+	}
+} MonkeyCounter;
+
+//Fires monkeys from both sides until each target count is reached, then samples frame timings at that count
+//A stage that can't reach its count (monkeys keep missing or the pool runs out) is sampled at the count it got to
+static struct sBenchmark
+{
+	const char* outPath;
+	int stage, throws, throwFrames, sampleFrames, reached;
+	std::vector<double> samples[4]; //step, render and collision while throwing, then step while idle
+	double pairs, awakeBodies;
+	int pairSteps;
+	ZL_String results;
+
+	enum { STAGES = 4, SAMPLE_FRAMES = 120, SETTLE_FRAMES = 180, THROWS_PER_FRAME = 4, MAX_THROW_FRAMES = 60 * 60 };
+
+	bool Active() { return outPath != NULL; }
+
+	static double Percentile(std::vector<double>& v, double pct)
+	{
+		std::sort(v.begin(), v.end());
+		return (v.empty() ? 0 : v[(size_t)((v.size() - 1) * pct)]);
+	}
+
+	void Frame(double renderTime)
+	{
+		static const int counts[STAGES] = { 100, 500, 1000, 5000 };
+		static const float charges[] = { 0.f, .25f, .5f, .75f, 1.f };
+		if (stage == STAGES) return;
+		if ((int)game.bodies.size() < counts[stage] && !sampleFrames && throwFrames++ < MAX_THROW_FRAMES)
+		{
+			for (int i = 0; i < THROWS_PER_FRAME; i++, throws++)
+				PostSimCommand(SIMCMD_THROW, ((throws & 1) ? 1.f : -1.f), 50.f + (throws * 37 % 200), charges[(throws / 2) % 5]);
+			return;
+		}
+		if (!sampleFrames) reached = (int)game.bodies.size();
+		int frame = sampleFrames++;
+		if (frame < SAMPLE_FRAMES)
+		{
+			samples[0].push_back(frameTimes.step * 1000), samples[1].push_back(renderTime * 1000), samples[2].push_back(frameTimes.collision * 1000);
+			pairs += frameTimes.pairs, pairSteps += frameTimes.steps;
+			return;
+		}
+		if (frame < SAMPLE_FRAMES + SETTLE_FRAMES) return; //no throws while the tree comes to rest
+		samples[3].push_back(frameTimes.step * 1000), awakeBodies += game.space->dynamicBodies->num;
+		if (frame < 2 * SAMPLE_FRAMES + SETTLE_FRAMES - 1) return;
+
+		results += ZL_String::format("%d,%d", counts[stage], reached);
+		for (int i = 0; i < 3; i++)
+			results += ZL_String::format(",%.4f,%.4f,%.4f", Percentile(samples[i], .5), Percentile(samples[i], .95), Percentile(samples[i], .99));
+		results += ZL_String::format(",%.1f,%.4f,%.4f,%.0f\n", pairs / (pairSteps ? pairSteps : 1), Percentile(samples[3], .5), Percentile(samples[3], .95), awakeBodies / SAMPLE_FRAMES);
+		for (int i = 0; i < 4; i++) samples[i].clear();
+		pairs = awakeBodies = 0, pairSteps = 0;
+		sampleFrames = throwFrames = 0;
+		if (++stage < STAGES) return;
+
+		FILE* f = fopen(outPath, "w");
+		if (f) { fprintf(f, "target,reached,step_p50_ms,step_p95_ms,step_p99_ms,render_p50_ms,render_p95_ms,render_p99_ms,collision_p50_ms,collision_p95_ms,collision_p99_ms,pairs_per_step,idle_step_p50_ms,idle_step_p95_ms,idle_awake_bodies\n%s", results.c_str()); fclose(f); }
+		printf("%s", results.c_str());
+		ZL_Application::Quit();
+	}
+} Benchmark;
+
+#ifdef ZILLALOG //PROFILER OVERLAY
+static void DrawProfiler(const sSnapshot& snap)
+{
+	static bool show;
+	static float frameMs[240];
+	static int frameIndex;
+	static ZL_TextBuffer txtLines[4] = { ZL_TextBuffer(fntMain), ZL_TextBuffer(fntMain), ZL_TextBuffer(fntMain), ZL_TextBuffer(fntMain) };
+	if (ZL_Input::Down(ZLK_F1)) show ^= true;
+	frameMs[frameIndex++ % 240] = ZLELAPSEDTICKS;
+	if (!show) return;
+
+	const sProfileStats& p = snap.prof;
+	ZL_String lines[4] = {
+		ZL_String::format("PHYSICS %.2f MS IN %d STEPS, POST STEP %.2f MS, QUALITY %d", p.stepMs, p.steps, p.postStepMs, p.quality),
+		ZL_String::format("DRAW MONKEYS %.2f MS, DRAW TEXT %.2f MS", profTimes[PROF_DRAWMONKEYS] * 1000, profTimes[PROF_DRAWTEXT] * 1000),
+		ZL_String::format("BODIES %d, ARBITERS %d, CONSTRAINTS %d, %s (F2)", p.bodies, p.arbiters, p.constraints, (p.spatialHash ? "SPATIAL HASH" : "BB TREE")),
+		ZL_String::format("FRAME %d MS, %d FPS", (int)ZLELAPSEDTICKS, ZL_Application::FPS),
+	};
+	ZL_Display::FillRect(0, ZLFROMH(190), 500, ZLHEIGHT, ZLLUMA(0, .6));
+	for (int i = 0; i < 4; i++)
+	{
+		txtLines[i].SetText(lines[i]);
+		txtLines[i].Draw(10, ZLFROMH(30 + i * 25), .35f, .35f, ZLWHITE, ZL_Origin::CenterLeft);
+	}
+
+	//Rolling frame time graph with a line at 16 ms
+	DebugBatch.Line(ZLV(10, ZLFROMH(180) + 16*2), ZLV(490, ZLFROMH(180) + 16*2), ZL_Color::Green);
+	for (int i = 1; i < 240; i++)
+		DebugBatch.Line(ZLV(10 + (i-1) * 2, ZLFROMH(180) + frameMs[(frameIndex + i - 1) % 240] * 2), ZLV(10 + i * 2, ZLFROMH(180) + frameMs[(frameIndex + i) % 240] * 2), ZL_Color::Yellow);
+	DebugBatch.Flush();
+}
+#endif
+
+//All arena worlds in a grid, each sprite type is drawn as one batch
+static void DrawArena(const sSnapshot& snap, float alpha)
+{
+	int cols = GetArenaColumns(), rows = ((int)arenaWorlds.size() + cols - 1) / cols;
+	float halfW = cols * ARENA_SPACING_X * .5f, halfH = rows * ARENA_SPACING_Y * .5f;
+	float camW = (halfW > halfH * ZLASPECTR ? halfW : halfH * ZLASPECTR), camH = camW / ZLASPECTR, camY = 100 - (rows - 1) * ARENA_SPACING_Y * .5f;
+	ZL_Display::PushOrtho(-camW, camW, camY - camH, camY + camH);
+	srfTree.BatchRenderBegin(true);
+	for (size_t i = 0; i != snap.arenaTrees.size(); i++)
+		srfTree.Draw(cpvlerp(snap.arenaTrees[i].prevP, snap.arenaTrees[i].p, alpha), ZL_Math::Lerp(snap.arenaTrees[i].prevA, snap.arenaTrees[i].a, alpha));
+	srfTree.BatchRenderEnd();
+	srfHill.BatchRenderBegin(true);
+	for (size_t i = 0; i != arenaWorlds.size(); i++)
+		srfHill.Draw(arenaWorlds[i].offset.x, arenaWorlds[i].offset.y - 60);
+	srfHill.BatchRenderEnd();
+	DrawMonkeys(snap.arenaMonkeys.data(), snap.arenaMonkeyCount, alpha, cpBBNew(-camW, camY - camH, camW, camY + camH));
+	ZL_Display::PopOrtho();
+
+	static ZL_TextBuffer txtArena(fntMain, "ARENA");
+	if (!(ZL_Application::FrameCount % 30) && snap.arenaStepTime > 0)
+		SetBakedText(txtArena, ZL_String::format("%d TREES, %d MONKEYS, %d THREADS, %.0f WORLD STEPS PER SECOND", (int)arenaWorlds.size(), snap.arenaMonkeyCount, ThreadPool.Workers(), arenaWorlds.size() * snap.arenaSteps / snap.arenaStepTime));
+	DrawTextBordered(txtArena, ZLV(ZLHALFW, 30), .5f);
 }
 
 static void Draw()
 {
-	static ticks_t TICKSUM = 0;
-	for (TICKSUM += ZLELAPSEDTICKS; TICKSUM > 16; TICKSUM -= 16)
-		cpSpaceStep(space, 2*s(16.0/1000.0));
+	#ifdef ZILLALOG
+	profTimes[PROF_DRAWMONKEYS] = profTimes[PROF_DRAWTEXT] = 0;
+	#endif
+	if (!simThreaded) SimFrame(ZLELAPSEDTICKS);
+	const sSnapshot& snap = AcquireSnapshot();
+	float alpha = ZL_Math::Clamp01((snap.accum + (ZL_Application::GetTicks() - snap.time)) / (float)stepTicks);
+
+	if (!arenaWorlds.empty())
+	{
+		ZL_Display::FillGradient(0, 0, ZLWIDTH, ZLHEIGHT, sky[0], sky[1], sky[2], sky[3]);
+		DrawArena(snap, alpha);
+		if (ZL_Input::Down(ZLK_ESCAPE)) ZL_Application::Quit();
+		#ifdef ZILLALOG
+		DrawProfiler(snap);
+		#endif
+		return;
+	}
 
 	static ticks_t TICKTITLESTART, TICKTITLEEND, TICKGAMEOVERSTART;
+	if ((Benchmark.Active() || replayPlaying) && !TICKTITLEEND) TICKTITLEEND = ZLTICKS - 1000;
 	float title = 0, gameover = 0;
 	if (!TICKTITLEEND)
 	{
@@ -180,28 +1910,49 @@ static void Draw()
 
 	ZL_Display::PushOrtho(camPos.x - camW, camPos.x + camW, camPos.y - camH, camPos.y + camH);
 
-	srfTree.Draw(bodyTree->p, bodyTree->a);
+	srfTree.Draw(cpvlerp(snap.treePrevP, snap.treeP, alpha), ZL_Math::Lerp(snap.treePrevA, snap.treeA, alpha));
 	srfHill.Draw(0, -60);
-	cpSpaceEachBody(space, (cpSpaceBodyIteratorFunc)DrawMonkey, NULL);
+	DrawMonkeys(snap.list.data(), snap.list.size(), alpha, cpBBNew(camPos.x - camW, camPos.y - camH, camPos.x + camW, camPos.y + camH));
 	ZL_Display::FillGradient(-1000, -100, 1000, 0, ZLLUMA(0,0), ZLLUMA(0,0), ZLLUMA(0,1), ZLLUMA(0,1));
 
-	if (sabs(bodyTree->a) > 1 && space->constraints->num)
+	static sSimEvent suggestion; //throw suggested by the assist mode, shown until the next throw
+	static ZL_TextBuffer txtSuggestion(fntMain);
+	for (sSimEvent e; simEvents.Pop(e);)
 	{
-		for (int i = space->constraints->num; i--;)
-			cpSpaceRemoveConstraint(space, (cpConstraint*)space->constraints->arr[i]);
-		sndGameOver.Play();
-		TICKGAMEOVERSTART = ZLTICKS;
-		gameover = SMALL_NUMBER;
-		txtMonkeys.SetText(ZL_String::format("YOU HAD %d MONKEYS ON THE TREE!", monkeys));
+		if (e.type == SIMEVT_GRAB)
+		{
+			MonkeyCounter.value = e.monkeys;
+			SoundEffects.Play(SFX_GRAB, .3f + e.impact / 300.f); //louder for faster monkeys
+		}
+		else if (e.type == SIMEVT_GAMEOVER)
+		{
+			SoundEffects.Play(SFX_GAMEOVER);
+			TICKGAMEOVERSTART = ZLTICKS;
+			gameover = SMALL_NUMBER;
+			SetBakedText(txtMonkeys, ZL_String::format("YOU HAD %d MONKEYS ON THE TREE!", e.monkeys));
+			suggestion.type = SIMEVT_GRAB;
+		}
+		else if (e.type == SIMEVT_RESTORED)
+		{
+			MonkeyCounter.value = e.monkeys;
+			TICKGAMEOVERSTART = 0;
+			gameover = 0;
+			suggestion.type = SIMEVT_GRAB;
+		}
+		else if (e.type == SIMEVT_SUGGESTION)
+		{
+			suggestion = e;
+			SetBakedText(txtSuggestion, ZL_String::format("ASSIST: %d%% GRAB CHANCE", (int)(e.grabChance * 100 + .5f)));
+		}
 	}
 
-	#ifdef ZILLALOG //DEBUG DRAW
-	if (ZL_Display::KeyDown[ZLK_LSHIFT])
+	#ifdef ZILLALOG //DEBUG DRAW (reads the space directly so only without simulation thread)
+	if (ZL_Display::KeyDown[ZLK_LSHIFT] && !simThreaded)
 	{
-		ZL_Display::DrawLine(-10000, 0, 10000, 0, ZL_Color::Gray);
-		ZL_Display::DrawLine(0, -10000, 0, 10000, ZL_Color::Gray);
-		void DebugDrawShape(cpShape*,void*); cpSpaceEachShape(space, DebugDrawShape, NULL);
-		void DebugDrawConstraint(cpConstraint*, void*); cpSpaceEachConstraint(space, DebugDrawConstraint, NULL);
+		DebugBatch.Line(ZLV(-10000, 0), ZLV(10000, 0), ZL_Color::Gray);
+		DebugBatch.Line(ZLV(0, -10000), ZLV(0, 10000), ZL_Color::Gray);
+		void DebugDrawShape(cpShape*,void*); cpSpaceEachShape(game.space, DebugDrawShape, NULL);
+		void DebugDrawConstraint(cpConstraint*, void*); cpSpaceEachConstraint(game.space, DebugDrawConstraint, NULL);
 	}
 	#endif
 
@@ -222,23 +1973,35 @@ static void Draw()
 			//if (ZL_Input::Held() && (ZL_Application::FrameCount % 6) == 0) { range = 1;
 			if (ZL_Input::Up())
 			{
-				float scale = RAND_RANGE(.8f, 1.25f);
-				cpBody *b = cpSpaceAddBody(space, cpBodyNew(3*scale, cpMomentForCircle(3*scale, 0, 5*scale, cpvzero)));
-				cpBodySetUserData(b, (cpDataPointer)(side < 0));
-				cpBodySetPosition(b, cpv(300*side, mousepos.y));
-				cpShape* shape = cpSpaceAddShape(space, cpCircleShapeNew(b, 12*scale, cpvzero));
-				cpShapeSetCollisionType(shape, COLLISION_MONKEY);
-				cpBodySetVelocity(b, cpv((100.f + range * 200.f) * -side, 0));
-				sndThrow.Play();
+				PostSimCommand(SIMCMD_THROW, side, mousepos.y, range);
+				SoundEffects.Play(SFX_THROW, .6f + .4f * range);
 				downstart = 0;
+				suggestion.type = SIMEVT_GRAB;
 			}
 		}
+		if (ZL_Input::Down(ZLK_TAB)) PostSimCommand(SIMCMD_SOLVE);
+		if (ZL_Input::Down(ZLK_BACKSPACE)) PostSimCommand(SIMCMD_REWIND);
+		if (ZL_Input::Down(ZLK_F2)) PostSimCommand(SIMCMD_BROADPHASE);
 
+		if (suggestion.type == SIMEVT_SUGGESTION)
+		{
+			ZL_Vector from = ZLV(suggestion.side * 200.f, suggestion.height), to = from - ZLV(200 * suggestion.charge * suggestion.side, 0);
+			DebugBatch.Line(from, to, ZLRGBA(0,.4,0,.6), 5, 1);
+			DebugBatch.Disc(to, 6, ZLRGBA(0,.4,0,.6), 1);
+			DebugBatch.Line(from, to, ZLRGBA(0,1,0,.6), 3, 2);
+			DebugBatch.Disc(to, 5, ZLRGBA(0,1,0,.6), 2);
+		}
+
+		//outline first, then the fill on top
 		ZL_Vector head = mousepos - ZLV(200 * range * side, 0);
-		ZL_Display::DrawWideLine(mousepos, head, 5, ZL_Color::Yellow, ZL_Color::Red);
-		ZL_Display::DrawTriangle(head - ZLV(0,10), head - ZLV(10*side,0), head - ZLV(0,-10), ZL_Color::Yellow, ZL_Color::Red);
-		ZL_Display::DrawCircle(mousepos, 5, ZL_Color::Yellow, ZL_Color::Red);
+		DebugBatch.Line(mousepos, head, ZL_Color::Red, 7, 3);
+		DebugBatch.Triangle(head - ZLV(12*side,0), head + ZLV(side,0), 24, ZL_Color::Red, 3);
+		DebugBatch.Disc(mousepos, 6, ZL_Color::Red, 3);
+		DebugBatch.Line(mousepos, head, ZL_Color::Yellow, 5, 4);
+		DebugBatch.Triangle(head - ZLV(10*side,0), head, 20, ZL_Color::Yellow, 4);
+		DebugBatch.Disc(mousepos, 5, ZL_Color::Yellow, 4);
 	}
+	DebugBatch.Flush();
 
 	ZL_Display::PopOrtho();
 
@@ -247,18 +2010,25 @@ static void Draw()
 		float overup = 400-ZL_Easing::OutBounce(gameover)*400;
 		static ZL_TextBuffer txtGameOver(fntMain, "GAME OVER");
 		static ZL_TextBuffer txtClickToRestart(fntMain, "CLICK TO RETURN TO TITLE");
+		static ZL_TextBuffer txtRetry(fntMain, "PRESS R TO RETRY FROM THE LAST STEADY TREE");
 		DrawTextBordered(txtGameOver, ZLV(ZLHALFW, ZLHALFH+120-overup), 1.1f, ZL_Color::Red, ZLBLACK, 4);
 		DrawTextBordered(txtMonkeys, ZLV(ZLHALFW, ZLHALFH-0-overup*.9f), .9f, ZL_Color::Yellow, ZLBLACK, 4);
 		DrawTextBordered(txtClickToRestart, ZLV(ZLHALFW, ZLHALFH-100-overup*.8f), .8f, ZLWHITE, ZLBLACK, 4);
-		if ((gameover > .8f && ZL_Input::Up()) || ZL_Input::Down(ZLK_ESCAPE))
+		if (!replayPlaying) DrawTextBordered(txtRetry, ZLV(ZLHALFW, ZLHALFH-160-overup*.7f), .5f, ZLWHITE, ZLBLACK, 3);
+		if (ZL_Input::Down(ZLK_R)) PostSimCommand(SIMCMD_RETRY);
+		else if ((gameover > .8f && ZL_Input::Up()) || ZL_Input::Down(ZLK_ESCAPE))
 		{
 			TICKGAMEOVERSTART = TICKTITLEEND = 0, TICKTITLESTART = ZLTICKS;
-			Reset();
+			unsigned int seed = NewSeed();
+			PostSimCommand(SIMCMD_RESET, 0, 0, 0, seed);
+			MonkeyCounter.value = 0;
+			NewSky(seed);
 		}
 	}
 	else if (!title)
 	{
-		DrawTextBordered(txtMonkeys, ZLV(ZLHALFW, 100));
+		MonkeyCounter.Draw(ZLV(ZLHALFW, 100));
+		if (suggestion.type == SIMEVT_SUGGESTION) DrawTextBordered(txtSuggestion, ZLV(ZLHALFW, 40), .5f, ZL_Color::Green);
 
 		static ticks_t TICKESCAPE;
 		if (TICKESCAPE && ZLSINCE(TICKESCAPE) < 1000)
@@ -266,10 +2036,11 @@ static void Draw()
 			static ZL_TextBuffer txtEscape(fntMain, "PRESS ESC AGAIN TO QUIT");
 			DrawTextBordered(txtEscape, ZLV(ZLHALFW, ZLHALFH));
 			if (ZL_Input::Down(ZLK_ESCAPE))
-				cpBodyApplyImpulseAtWorldPoint(bodyTree, cpv(10000, 0), cpv(0, 200));
+				PostSimCommand(SIMCMD_IMPULSE);
 		}
 		else if (ZL_Input::Down(ZLK_ESCAPE))
 			TICKESCAPE = ZLTICKS;
+		if (ZL_Input::Down(ZLK_R)) PostSimCommand(SIMCMD_RETRY);
 	}
 	else
 	{
@@ -277,7 +2048,19 @@ static void Draw()
 
 		float logoup = 450-(TICKTITLEEND ? ZL_Easing::InQuad(title) : ZL_Easing::OutBounce(title))*450;
 
-		for (int i = 0; i != 9; i++)  if (i != 4) srfLogo.Draw(ZLHALFW-3+8*(i/3), ZLHALFH+150+3-8*(i%3)+logoup*.9f, ZLLUMA(0, .5));
+		static ZL_Surface srfLogoShadow;
+		static bool logoShadowBaked;
+		if (!logoShadowBaked)
+		{
+			logoShadowBaked = true;
+			int w = (int)srfLogo.GetWidth() + 16, h = (int)srfLogo.GetHeight() + 16;
+			srfLogoShadow = ZL_Surface(w, h, true);
+			srfLogoShadow.SetOrigin(ZL_Origin::Center);
+			srfLogoShadow.RenderToBegin(true);
+			for (int i = 0; i != 9; i++)  if (i != 4) srfLogo.Draw(w*.5f-8+8*(i/3), h*.5f+8-8*(i%3), ZLLUMA(0, .5)); //overlapping copies stack to a dark core with a soft edge
+			srfLogoShadow.RenderToEnd();
+		}
+		srfLogoShadow.Draw(ZLHALFW+5, ZLHALFH+150-5+logoup*.9f, ZLWHITE);
 		srfLogo.Draw(ZLHALFW, ZLHALFH+150+logoup);
 
 		static ZL_TextBuffer txtClickToPlay(fntMain, "CLICK TO START");
@@ -299,6 +2082,77 @@ static void Draw()
 		if (ZL_Input::Down(ZLK_ESCAPE) && !TICKTITLEEND)
 			ZL_Application::Quit();
 	}
+
+	SoundEffects.Flush();
+
+	#ifdef ZILLALOG
+	DrawProfiler(snap);
+	#endif
+}
+
+static bool LoadThrowScript(const char* path, std::vector<sReplayInput>& inputs)
+{
+	FILE* f = fopen(path, "r");
+	if (!f) return false;
+	char line[256];
+	int frame;
+	float side, height, charge;
+	while (fgets(line, sizeof(line), f))
+	{
+		if (line[0] == '#' || sscanf(line, "%d %f %f %f", &frame, &side, &height, &charge) != 4) continue;
+		inputs.push_back(QuantizeInput((unsigned int)frame, INPUT_THROW, side, height, charge));
+	}
+	fclose(f);
+	struct StepOrder { bool operator()(const sReplayInput& a, const sReplayInput& b) const { return a.step < b.step; } };
+	std::stable_sort(inputs.begin(), inputs.end(), StepOrder());
+	return true;
+}
+
+//Steps the arena as fast as possible to measure how throughput scales with the number of threads
+static int RunHeadlessArena(int count)
+{
+	enum { STEPS = 3000, STEPS_PER_TASK = 10 };
+	headless = true;
+	Reset(fixedSeed ? fixedSeed : 1);
+	InitArena(count);
+	double t = PerfTime();
+	for (int i = 0; i < STEPS; i += STEPS_PER_TASK) StepArena(STEPS_PER_TASK);
+	t = PerfTime() - t;
+	printf("%d worlds x %d steps on %d threads in %d ms (%.0f world steps per second)\n", count, (int)STEPS, ThreadPool.Workers(), (int)(t * 1000), count * STEPS / (t > 0 ? t : 1));
+	return 0;
+}
+
+//Replays throw scripts (one throw per line: frame side height charge) or recorded replay files without window, GPU or audio
+static int RunHeadless(int count, char** scripts)
+{
+	headless = replayPlaying = true;
+	const bool cmdRigidAttach = rigidAttach, cmdSpatialHash = spatialHash, cmdLooseFilter = looseFilter, cmdSleeping = sleeping;
+	const ticks_t cmdStepTicks = stepTicks;
+	int totalFrames = 0, result = 0;
+	double totalPairs = 0;
+	ticks_t start = ZL_Application::GetTicks();
+	for (int n = 0; n < count; n++)
+	{
+		unsigned int seed = (fixedSeed ? fixedSeed : 1);
+		std::vector<sReplayInput> inputs;
+		rigidAttach = cmdRigidAttach, spatialHash = cmdSpatialHash, looseFilter = cmdLooseFilter, sleeping = cmdSleeping, stepTicks = cmdStepTicks; //a replay file before this one may have changed them
+		if (!LoadReplay(scripts[n], seed, inputs) && !LoadThrowScript(scripts[n], inputs)) { fprintf(stderr, "%s: could not read throw script\n", scripts[n]); result = 1; continue; }
+
+		replayInputs.swap(inputs);
+		Reset(seed);
+		int lastFrame = (replayInputs.empty() ? 0 : (int)replayInputs.back().step) + 300;
+		bool tipped = false;
+		while ((int)game.step <= lastFrame && !tipped) tipped = StepGame();
+		totalFrames += game.step;
+		totalPairs += frameTimes.pairs;
+		frameTimes.pairs = 0;
+		printf("%s: %d monkeys%s after %d frames\n", scripts[n], game.monkeys, (tipped ? " (tree tipped over)" : ""), (int)game.step);
+	}
+	printf("Allocations: %u space, %u pooled monkeys taken, %u released, %u times pool exhausted\n", allocStats.spaceAllocs, game.poolStats.taken, game.poolStats.released, game.poolStats.exhausted);
+	ticks_t elapsed = ZL_Application::GetTicks() - start;
+	printf("%d frames in %d ms (%.0f frames per second)\n", totalFrames, (int)elapsed, totalFrames * 1000.0 / (elapsed ? elapsed : 1));
+	printf("%.1f collision pairs per step (%s, loose monkey filter %s)\n", totalPairs / (totalFrames ? totalFrames : 1), (spatialHash ? "spatial hash" : "bounding box tree"), (looseFilter ? "on" : "off"));
+	return result;
 }
 
 static struct sWobblezilla : public ZL_Application
@@ -307,6 +2161,53 @@ static struct sWobblezilla : public ZL_Application
 
 	virtual void Load(int argc, char *argv[])
 	{
+		std::vector<char*> scripts;
+		bool runHeadless = false;
+		int arenaCount = 0;
+		const char* telemetryPath = NULL;
+		for (int i = 1; i < argc; i++)
+		{
+			if      (!strcmp(argv[i], "-headless")) runHeadless = true;
+			else if (!strcmp(argv[i], "-steprate") && i+1 < argc && atoi(argv[i+1]) >= 1000 / MAX_STEP_TICKS && atoi(argv[i+1]) <= 1000 / MIN_STEP_TICKS) stepTicks = 1000 / atoi(argv[++i]);
+			else if (!strcmp(argv[i], "-maxsubsteps") && i+1 < argc && atoi(argv[i+1]) >= 1) maxSubSteps = atoi(argv[++i]);
+			else if (!strcmp(argv[i], "-rigidattach")) rigidAttach = true;
+			else if (!strcmp(argv[i], "-spatialhash")) spatialHash = true;
+			else if (!strcmp(argv[i], "-nofilter")) looseFilter = false;
+			else if (!strcmp(argv[i], "-sleep")) sleeping = true;
+			else if (!strcmp(argv[i], "-quality") && i+1 < argc)
+			{
+				const char* name = argv[++i];
+				qualityPreset = NULL;
+				for (size_t p = 0; p != sizeof(qualityPresets) / sizeof(qualityPresets[0]); p++) if (!strcmp(name, qualityPresets[p].name)) qualityPreset = &qualityPresets[p];
+				if (!qualityPreset && strcmp(name, "off")) { fprintf(stderr, "%s: unknown quality preset\n", name); exit(1); }
+			}
+			else if (!strcmp(argv[i], "-arena") && i+1 < argc && atoi(argv[i+1]) >= 1) arenaCount = atoi(argv[++i]);
+			else if (!strcmp(argv[i], "-threads") && i+1 < argc && atoi(argv[i+1]) >= 1) ThreadPool.maxThreads = atoi(argv[++i]);
+			else if (!strcmp(argv[i], "-seed") && i+1 < argc) fixedSeed = (unsigned int)strtoul(argv[++i], NULL, 10);
+			else if (!strcmp(argv[i], "-record") && i+1 < argc) replayRecordPath = argv[++i];
+			else if (!strcmp(argv[i], "-telemetry") && i+1 < argc) telemetryPath = argv[++i];
+			else if (!strcmp(argv[i], "-replay") && i+1 < argc)
+			{
+				if (!LoadReplay(argv[++i], fixedSeed, replayInputs)) { fprintf(stderr, "%s: could not read replay\n", argv[i]); exit(1); }
+				replayPlaying = true;
+			}
+			else if (!strcmp(argv[i], "-liveaudio")) liveAudio = true;
+			else if (!strcmp(argv[i], "-audiofiles"))
+			{
+				printf("%s\n%s\n%s\n%s\n", BakedAudioPath("music", &imcDataIMCMUSIC).c_str(), BakedAudioPath("grab", &imcDataIMCGRAB).c_str(), BakedAudioPath("throw", &imcDataIMCTHROW).c_str(), BakedAudioPath("gameover", &imcDataIMCGAMEOVER).c_str());
+				exit(0);
+			}
+			else if (!strcmp(argv[i], "-benchmark")) Benchmark.outPath = (i+1 < argc && argv[i+1][0] != '-' ? argv[++i] : "benchmark.csv");
+			#ifdef SIM_THREAD_SUPPORT
+			else if (!strcmp(argv[i], "-simthread")) simThreaded = true;
+			#endif
+			else if (argv[i][0] != '-') scripts.push_back(argv[i]);
+		}
+		if (telemetryPath && !Telemetry.Open(telemetryPath)) { fprintf(stderr, "%s: could not create telemetry log\n", telemetryPath); exit(1); }
+		Telemetry.wait = runHeadless;
+		if (runHeadless && arenaCount) exit(RunHeadlessArena(arenaCount));
+		if (runHeadless) exit(RunHeadless((int)scripts.size(), scripts.data()));
+		if (Benchmark.Active()) simThreaded = false, timeCallbacks = holdTreeUpright = true, qualityPreset = NULL;
 		if (!ZL_Application::LoadReleaseDesktopDataBundle()) return;
 		if (!ZL_Display::Init("Super Monkey Call", 1280, 720, ZL_DISPLAY_ALLOWRESIZEHORIZONTAL)) return;
 		ZL_Display::ClearFill(ZL_Color::White);
@@ -314,11 +2215,19 @@ static struct sWobblezilla : public ZL_Application
 		ZL_Audio::Init();
 		ZL_Input::Init();
 		Init();
+		if (arenaCount) InitArena(arenaCount), ThreadPool.Workers(); //start the workers before the simulation thread uses them
+		PublishSnapshot(0); //the first frames can be drawn before the first step
+		#ifdef SIM_THREAD_SUPPORT
+		if (simThreaded) SimThread.Start();
+		#endif
 	}
 
 	virtual void AfterFrame()
 	{
+		if (!Benchmark.Active()) { Draw(); return; }
+		double t = PerfTime();
 		Draw();
+		Benchmark.Frame(PerfTime() - t - frameTimes.sim);
 	}
 } Wobblezilla;
 
@@ -329,25 +2238,23 @@ void DebugDrawShape(cpShape *shape, void*)
 	{
 		case CP_CIRCLE_SHAPE: {
 			cpCircleShape *circle = (cpCircleShape *)shape;
-			ZL_Display::DrawCircle(circle->tc, circle->r, ZL_Color::Green);
+			DebugBatch.Circle(circle->tc, circle->r, ZL_Color::Green);
 			break; }
 		case CP_SEGMENT_SHAPE: {
 			cpSegmentShape *seg = (cpSegmentShape *)shape;
-			cpVect vw = cpvclamp(cpvperp(cpvsub(seg->tb, seg->ta)), seg->r);
-			//ZL_Display::DrawLine(seg->ta, seg->tb, ZLWHITE);
-			ZL_Display::DrawQuad(seg->ta.x + vw.x, seg->ta.y + vw.y, seg->tb.x + vw.x, seg->tb.y + vw.y, seg->tb.x - vw.x, seg->tb.y - vw.y, seg->ta.x - vw.x, seg->ta.y - vw.y, ZLRGBA(0,1,1,.35), ZLRGBA(1,1,0,.35));
-			ZL_Display::DrawCircle(seg->ta, seg->r, ZLRGBA(0,1,1,.35), ZLRGBA(1,1,0,.35));
-			ZL_Display::DrawCircle(seg->tb, seg->r, ZLRGBA(0,1,1,.35), ZLRGBA(1,1,0,.35));
+			DebugBatch.Line(seg->ta, seg->tb, ZLRGBA(1,1,0,.35), seg->r * 2);
+			DebugBatch.Disc(seg->ta, seg->r, ZLRGBA(1,1,0,.35));
+			DebugBatch.Disc(seg->tb, seg->r, ZLRGBA(1,1,0,.35));
 			break; }
 		case CP_POLY_SHAPE: {
 			cpPolyShape *poly = (cpPolyShape *)shape;
-			{for (int i = 1; i < poly->count; i++) ZL_Display::DrawLine(poly->planes[i-1].v0, poly->planes[i].v0, ZLWHITE);}
-			ZL_Display::DrawLine(poly->planes[poly->count-1].v0, poly->planes[0].v0, ZLWHITE);
+			{for (int i = 1; i < poly->count; i++) DebugBatch.Line(poly->planes[i-1].v0, poly->planes[i].v0, ZLWHITE);}
+			DebugBatch.Line(poly->planes[poly->count-1].v0, poly->planes[0].v0, ZLWHITE);
 			break; }
 	}
-	ZL_Display::FillCircle(cpBodyGetPosition(shape->body), 3, ZL_Color::Red);
-	ZL_Display::DrawLine(cpBodyGetPosition(shape->body), (ZL_Vector&)cpBodyGetPosition(shape->body) + ZLV(cpBodyGetAngularVelocity(shape->body)*-10, 0), ZLRGB(1,0,0));
-	ZL_Display::DrawLine(cpBodyGetPosition(shape->body), (ZL_Vector&)cpBodyGetPosition(shape->body) + ZL_Vector::FromAngle(cpBodyGetAngle(shape->body))*10, ZLRGB(1,1,0));
+	DebugBatch.Disc(cpBodyGetPosition(shape->body), 3, ZL_Color::Red, 1);
+	DebugBatch.Line(cpBodyGetPosition(shape->body), (ZL_Vector&)cpBodyGetPosition(shape->body) + ZLV(cpBodyGetAngularVelocity(shape->body)*-10, 0), ZLRGB(1,0,0), 1, 1);
+	DebugBatch.Line(cpBodyGetPosition(shape->body), (ZL_Vector&)cpBodyGetPosition(shape->body) + ZL_Vector::FromAngle(cpBodyGetAngle(shape->body))*10, ZLRGB(1,1,0), 1, 1);
 }
 
 void DebugDrawConstraint(cpConstraint *constraint, void *data)
@@ -359,16 +2266,16 @@ void DebugDrawConstraint(cpConstraint *constraint, void *data)
 		cpPinJoint *joint = (cpPinJoint *)constraint;
 		cpVect a = (cpBodyGetType(body_a) == CP_BODY_TYPE_KINEMATIC ? body_a->p : cpTransformPoint(body_a->transform, joint->anchorA));
 		cpVect b = (cpBodyGetType(body_b) == CP_BODY_TYPE_KINEMATIC ? body_b->p : cpTransformPoint(body_b->transform, joint->anchorB));
-		ZL_Display::DrawLine(a.x, a.y, b.x, b.y, ZL_Color::Magenta);
+		DebugBatch.Line(a, b, ZL_Color::Magenta, 1, 1);
 	}
 	else if (cpConstraintIsPivotJoint(constraint))
 	{
 		cpPivotJoint *joint = (cpPivotJoint *)constraint;
 		cpVect a = (cpBodyGetType(body_a) == CP_BODY_TYPE_KINEMATIC ? body_a->p : cpTransformPoint(body_a->transform, joint->anchorA));
 		cpVect b = (cpBodyGetType(body_b) == CP_BODY_TYPE_KINEMATIC ? body_b->p : cpTransformPoint(body_b->transform, joint->anchorB));
-		ZL_Display::DrawLine(a.x, a.y, b.x, b.y, ZL_Color::Magenta);
-		ZL_Display::FillCircle(a, 2, ZL_Color::Magenta);
-		ZL_Display::FillCircle(b, 2, ZL_Color::Magenta);
+		DebugBatch.Line(a, b, ZL_Color::Magenta, 1, 1);
+		DebugBatch.Disc(a, 2, ZL_Color::Magenta, 1);
+		DebugBatch.Disc(b, 2, ZL_Color::Magenta, 1);
 	}
 	else if (cpConstraintIsRotaryLimitJoint(constraint))
 	{
@@ -376,8 +2283,8 @@ void DebugDrawConstraint(cpConstraint *constraint, void *data)
 		cpVect a = cpTransformPoint(body_a->transform, cpvzero);
 		cpVect b = cpvadd(a, cpvmult(cpvforangle(joint->min), 40));
 		cpVect c = cpvadd(a, cpvmult(cpvforangle(joint->max), 40));
-		ZL_Display::DrawLine(a.x, a.y, b.x, b.y, ZL_Color::Magenta);
-		ZL_Display::DrawLine(a.x, a.y, c.x, c.y, ZL_Color::Magenta);
+		DebugBatch.Line(a, b, ZL_Color::Magenta, 1, 1);
+		DebugBatch.Line(a, c, ZL_Color::Magenta, 1, 1);
 	}
 }
 #endif
@@ -586,3 +2493,32 @@ TImcSongData imcDataIMCGAMEOVER = {
 	/*LEN*/ 0x1, /*ROWLENSAMPLES*/ 4033, /*ENVLISTSIZE*/ 3, /*ENVCOUNTERLISTSIZE*/ 4, /*OSCLISTSIZE*/ 9, /*EFFECTLISTSIZE*/ 0, /*VOL*/ 100,
 	IMCGAMEOVER_OrderTable, IMCGAMEOVER_PatternData, IMCGAMEOVER_PatternLookupTable, IMCGAMEOVER_EnvList, IMCGAMEOVER_EnvCounterList, IMCGAMEOVER_OscillatorList, NULL,
 	IMCGAMEOVER_ChannelVol, IMCGAMEOVER_ChannelEnvCounter, IMCGAMEOVER_ChannelStopNote };
+
+//Hash of the header values and the constant tables of a song for naming baked audio files
+//The envelope counters and channel volumes are left out, the synthesizer writes to them while playing
+struct sImcTable { const void* data; size_t size; };
+#define IMC_TABLE(t) { t, sizeof(t) }
+static unsigned int HashImcTables(const TImcSongData* song, const sImcTable* tables, size_t count)
+{
+	unsigned int h = 2166136261u;
+	const unsigned char* header = (const unsigned char*)song; //the leading scalar fields from length to volume
+	for (size_t i = 0; i != 7 * sizeof(unsigned int); i++) h = (h ^ header[i]) * 16777619u;
+	for (size_t t = 0; t != count; t++)
+		for (size_t i = 0; i != tables[t].size; i++) h = (h ^ ((const unsigned char*)tables[t].data)[i]) * 16777619u;
+	return h;
+}
+
+unsigned int HashImcSong(const TImcSongData* song)
+{
+	static const sImcTable music[] = { IMC_TABLE(IMCMUSIC_OrderTable), IMC_TABLE(IMCMUSIC_PatternData), IMC_TABLE(IMCMUSIC_PatternLookupTable), IMC_TABLE(IMCMUSIC_EnvList), IMC_TABLE(IMCMUSIC_OscillatorList), IMC_TABLE(IMCMUSIC_EffectList), IMC_TABLE(IMCMUSIC_ChannelEnvCounter), IMC_TABLE(IMCMUSIC_ChannelStopNote) };
+	static const sImcTable grab[] = { IMC_TABLE(IMCGRAB_OrderTable), IMC_TABLE(IMCGRAB_PatternData), IMC_TABLE(IMCGRAB_PatternLookupTable), IMC_TABLE(IMCGRAB_EnvList), IMC_TABLE(IMCGRAB_OscillatorList), IMC_TABLE(IMCGRAB_EffectList), IMC_TABLE(IMCGRAB_ChannelEnvCounter), IMC_TABLE(IMCGRAB_ChannelStopNote) };
+	static const sImcTable throws[] = { IMC_TABLE(IMCTHROW_OrderTable), IMC_TABLE(IMCTHROW_PatternData), IMC_TABLE(IMCTHROW_PatternLookupTable), IMC_TABLE(IMCTHROW_EnvList), IMC_TABLE(IMCTHROW_OscillatorList), IMC_TABLE(IMCTHROW_EffectList), IMC_TABLE(IMCTHROW_ChannelEnvCounter), IMC_TABLE(IMCTHROW_ChannelStopNote) };
+	static const sImcTable gameover[] = { IMC_TABLE(IMCGAMEOVER_OrderTable), IMC_TABLE(IMCGAMEOVER_PatternData), IMC_TABLE(IMCGAMEOVER_PatternLookupTable), IMC_TABLE(IMCGAMEOVER_EnvList), IMC_TABLE(IMCGAMEOVER_OscillatorList), IMC_TABLE(IMCGAMEOVER_ChannelEnvCounter), IMC_TABLE(IMCGAMEOVER_ChannelStopNote) };
+	#define HASH_SONG(t) HashImcTables(song, t, sizeof(t) / sizeof(t[0]))
+	if (song == &imcDataIMCMUSIC) return HASH_SONG(music);
+	if (song == &imcDataIMCGRAB) return HASH_SONG(grab);
+	if (song == &imcDataIMCTHROW) return HASH_SONG(throws);
+	if (song == &imcDataIMCGAMEOVER) return HASH_SONG(gameover);
+	#undef HASH_SONG
+	return 0;
+}
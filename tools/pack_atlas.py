@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# Packs the sprites from Assets/ tightly into Data/atlas.png and writes the pixel rect of each sprite into main.cpp.
+# Sprites are placed tallest first at the lowest free spot of a skyline, trying every atlas width to find the smallest area.
+# The sprite order must match the ATLAS_* indices in main.cpp.
+import os, re, struct, sys, zlib
+
+SPRITES = ['tree.png', 'logo.png', 'hill.png', 'monkey.png']
+PADDING = 2 #transparent pixels between sprites so filtering never samples a neighbor
+
+def read_png(path):
+	data = open(path, 'rb').read()
+	assert data[:8] == b'\x89PNG\r\n\x1a\n', path
+	pos, idat = 8, b''
+	while pos < len(data):
+		length, kind = struct.unpack('>I4s', data[pos:pos+8])
+		body = data[pos+8:pos+8+length]
+		if kind == b'IHDR':
+			w, h, depth, color, _, _, interlace = struct.unpack('>IIBBBBB', body)
+			assert depth == 8 and color == 6 and not interlace, path + ': only 8-bit RGBA non-interlaced is supported'
+		elif kind == b'IDAT': idat += body
+		pos += 12 + length
+	raw, stride, rows, prev = zlib.decompress(idat), w * 4, [], bytearray(w * 4)
+	for y in range(h):
+		filt, line = raw[y*(stride+1)], bytearray(raw[y*(stride+1)+1:(y+1)*(stride+1)])
+		for x in range(stride):
+			a = line[x-4] if x >= 4 else 0
+			b, c = prev[x], (prev[x-4] if x >= 4 else 0)
+			if filt == 1: line[x] = (line[x] + a) & 255
+			elif filt == 2: line[x] = (line[x] + b) & 255
+			elif filt == 3: line[x] = (line[x] + (a + b) // 2) & 255
+			elif filt == 4:
+				p = a + b - c; pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+				line[x] = (line[x] + (a if pa <= pb and pa <= pc else b if pb <= pc else c)) & 255
+		rows.append(line)
+		prev = line
+	return w, h, rows
+
+def write_png(path, w, h, rows):
+	def chunk(kind, body): return struct.pack('>I', len(body)) + kind + body + struct.pack('>I', zlib.crc32(kind + body) & 0xffffffff)
+	raw = b''.join(b'\0' + bytes(r) for r in rows) #unfiltered compresses best for this flat colored art
+	open(path, 'wb').write(b'\x89PNG\r\n\x1a\n' + chunk(b'IHDR', struct.pack('>IIBBBBB', w, h, 8, 6, 0, 0, 0)) + chunk(b'IDAT', zlib.compress(raw, 9)) + chunk(b'IEND', b''))
+
+def pack(sizes, width):
+	skyline, rects = [(0, width, 0)], [None] * len(sizes) #segments of (x, width, top)
+	for n in sorted(range(len(sizes)), key=lambda n: (-sizes[n][1], -sizes[n][0])):
+		w, h = sizes[n]
+		best = None
+		for i, (x, _, _) in enumerate(skyline):
+			if x + w > width: break
+			top, covered, j = 0, 0, i
+			while covered < w: top, covered, j = max(top, skyline[j][2]), covered + skyline[j][1], j + 1
+			if best is None or top < best[1]: best = (x, top)
+		if best is None: return None
+		x, top = best
+		rects[n] = (x, top, w, h)
+		cut = []
+		for sx, sw, st in skyline: #replace the covered part of the skyline with the top of the new sprite
+			if sx + sw <= x or sx >= x + w: cut.append((sx, sw, st))
+			else:
+				if sx < x: cut.append((sx, x - sx, st))
+				if sx + sw > x + w: cut.append((x + w, sx + sw - x - w, st))
+		skyline = sorted(cut + [(x, w, top + h)])
+	return rects
+
+root = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+images = [read_png(os.path.join(root, 'Assets', name)) for name in SPRITES]
+sizes = [(w + PADDING, h + PADDING) for w, h, _ in images]
+layouts = []
+for width in range(max(w for w, _ in sizes), sum(w for w, _ in sizes) + 1, 2):
+	rects = pack(sizes, width)
+	if rects: layouts.append((width * max(y + h for _, y, _, h in rects), width, rects))
+_, width, rects = min(layouts)
+width, height = max(x + w for x, _, w, _ in rects) - PADDING, max(y + h for _, y, _, h in rects) - PADDING
+atlas = [bytearray(width * 4) for _ in range(height)]
+for (w, h, rows), (ox, oy, _, _) in zip(images, rects):
+	for y in range(h): atlas[oy + y][ox*4:(ox+w)*4] = rows[y]
+write_png(os.path.join(root, 'Data', 'atlas.png'), width, height, atlas)
+
+table = 'static const sAtlasRect atlasRects[ATLAS_COUNT] = { %s };' % ', '.join('{ %d, %d, %d, %d }' % (x, y, w, h) for (x, y, _, _), (w, h, _) in zip(rects, images))
+source = open(os.path.join(root, 'main.cpp'), newline='').read()
+source, found = re.subn(r'static const sAtlasRect atlasRects\[ATLAS_COUNT\] = \{.*?\};', table, source)
+if not found: sys.exit('main.cpp: atlasRects table not found')
+open(os.path.join(root, 'main.cpp'), 'w', newline='').write(source)
+print('Data/atlas.png: %dx%d (%d%% of the sprite pixels)' % (width, height, 100 * width * height // sum(w * h for w, h, _ in images)))
+for name, (x, y, _, _), (w, h, _) in zip(SPRITES, rects, images): print('  %s at %d,%d size %dx%d' % (name, x, y, w, h))
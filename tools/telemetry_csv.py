@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+# Turns a telemetry log written with -telemetry into CSV summaries.
+# Prints one line per game (a new game starts when the step counter goes back, after a reset, rewind or retry).
+# Usage: telemetry_csv.py LOG [--steps STEPS.csv] [--grabs GRABS.csv]
+import struct, sys
+
+STEP_COLUMNS = [('step', 'I'), ('angle', 'f'), ('angular_velocity', 'f'), ('monkeys', 'I'), ('constraints', 'I'), ('step_us', 'f')]
+GRAB_COLUMNS = [('record', 'I'), ('hit_x', 'f'), ('hit_y', 'f'), ('normal_x', 'f'), ('normal_y', 'f'), ('depth', 'f'), ('impact', 'f')]
+
+def read_log(path):
+	data = open(path, 'rb').read()
+	assert data[:4] == b'SMCT' and data[4] == 1, path + ': not a telemetry log'
+	step_ticks, pos, steps, grabs = data[6] | (data[7] << 8), 8, {}, []
+	def columns(count, layout):
+		nonlocal pos
+		cols = []
+		for _, kind in layout:
+			cols.append(struct.unpack_from('<%d%s' % (count, kind), data, pos))
+			pos += 4 * count
+		return list(zip(*cols))
+	while pos + 12 <= len(data):
+		first, nsteps, ngrabs = struct.unpack_from('<III', data, pos)
+		pos += 12
+		if pos + 4 * (nsteps * len(STEP_COLUMNS) + ngrabs * len(GRAB_COLUMNS)) > len(data): break #truncated by a crash
+		for i, s in enumerate(columns(nsteps, STEP_COLUMNS)): steps[first + i] = s
+		grabs += columns(ngrabs, GRAB_COLUMNS)
+	return step_ticks, steps, grabs
+
+def split_games(steps, grabs):
+	games, game_of = [], {}
+	for record in sorted(steps):
+		s = steps[record]
+		if not games or s[0] <= games[-1][0][-1][0]: games.append(([], []))
+		games[-1][0].append(s)
+		game_of[record] = len(games) - 1
+	for g in grabs:
+		if g[0] in game_of: games[game_of[g[0]]][1].append(g) #blocks dropped while the disk was busy leave holes
+	return games
+
+def percentile(values, p):
+	values = sorted(values)
+	return values[min(len(values) - 1, int(len(values) * p))] if values else 0
+
+def write_csv(path, header, rows):
+	with open(path, 'w') as f:
+		f.write(','.join(header) + '\n')
+		for r in rows: f.write(','.join('%.6g' % v for v in r) + '\n')
+
+def main(args):
+	if not args or args[0].startswith('-'): sys.exit('Usage: telemetry_csv.py LOG [--steps STEPS.csv] [--grabs GRABS.csv]')
+	step_ticks, steps, grabs = read_log(args[0])
+	for opt, header, rows in (('--steps', STEP_COLUMNS, [steps[r] for r in sorted(steps)]), ('--grabs', GRAB_COLUMNS, grabs)):
+		if opt in args: write_csv(args[args.index(opt) + 1], [name for name, _ in header], rows)
+
+	print('game,seconds,monkeys,max_monkeys,tipped,max_abs_angle,max_abs_angular_velocity,max_constraints,grabs,mean_grab_x,mean_impact,max_impact,step_ms_p50,step_ms_p95')
+	for i, (gs, gg) in enumerate(split_games(steps, grabs)):
+		impacts = [g[6] for g in gg]
+		print('%d,%.2f,%d,%d,%d,%.3f,%.3f,%d,%d,%.1f,%.1f,%.1f,%.3f,%.3f' % (i, len(gs) * step_ticks / 1000.0, gs[-1][3], max(s[3] for s in gs),
+			abs(gs[-1][1]) > 1, max(abs(s[1]) for s in gs), max(abs(s[2]) for s in gs), max(s[4] for s in gs), len(gg),
+			sum(g[1] for g in gg) / len(gg) if gg else 0, sum(impacts) / len(impacts) if impacts else 0, max(impacts) if impacts else 0,
+			percentile([s[5] for s in gs], .5) / 1000, percentile([s[5] for s in gs], .95) / 1000))
+
+if __name__ == '__main__': main(sys.argv[1:])